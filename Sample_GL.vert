@@ -1,22 +1,41 @@
 #version 330 core
 
 // input data : sent from main program
-layout (location = 0) in vec3 vertexPosition;
-layout (location = 1) in vec3 vertexColor;
+layout (location = 0) in vec2 vertexPosition;
+layout (location = 1) in vec4 vertexColor;
 
-uniform mat4 MVP;
+// per instance data : only set for instanced draws, (0,0) and (1,1,1,1) otherwise
+layout (location = 2) in vec2 instanceOffset;
+layout (location = 3) in vec4 instanceTint;
+
+// projection * view : updated once per frame
+layout (std140) uniform Camera
+{
+    mat4 VP;
+};
+
+// model matrices of every object, one column per texel, picked by draw id
+uniform samplerBuffer Models;
+uniform int ModelIndex;
+
+// world z of this draw : keeps painter order under the depth test
+uniform float Depth;
 
 // output data : used by fragment shader
 out vec3 fragColor;
 
 void main ()
 {
-    vec4 v = vec4(vertexPosition, 1); // Transform an homogeneous 4D vector
+    vec4 v = vec4(vertexPosition + instanceOffset, Depth, 1); // Transform an homogeneous 4D vector
 
     // The color of each vertex will be interpolated
     // to produce the color of each fragment
-    fragColor = vertexColor;
+    fragColor = vertexColor.rgb * instanceTint.rgb;
 
     // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
+    mat4 model = mat4(texelFetch(Models, 4*ModelIndex),
+                      texelFetch(Models, 4*ModelIndex + 1),
+                      texelFetch(Models, 4*ModelIndex + 2),
+                      texelFetch(Models, 4*ModelIndex + 3));
+    gl_Position = VP * model * v;
 }
@@ -1,11 +1,35 @@
 #include <iostream>
+#include <algorithm>
 #include <cmath>
+#include <cfloat>
 #include <fstream>
 #include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
 #include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+/* The AVX2 kernels are built into every x86 binary and picked at run time, so the default build uses them too */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define AVX2_KERNELS
+#include <immintrin.h>
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#ifdef BENCH_RENDER
+#define EGL_NO_X11
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #define DEG2RAD(p) p*(6.28/360)
 #define RAD2DEG(p) p*(360/6.28)
 #define GLM_FORCE_RADIANS
@@ -15,28 +39,173 @@
 
 using namespace std;
 
+/* Seconds on the game clock - GLFW's timer, or the system clock in the render benchmark, which has no GLFW */
+double clockTime ()
+{
+#ifdef BENCH_RENDER
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec*1e-9;
+#else
+	return glfwGetTime();
+#endif
+}
+
+/* Tracing - begin and end events go into a buffer per thread and are written out at exit as Chrome
+ * trace_event JSON, for chrome://tracing or ui.perfetto.dev. Compiled out unless built with -DENABLE_TRACING */
+#ifdef ENABLE_TRACING
+struct TraceEvent {
+	const char* Name; // string literal, only the pointer is kept
+	char Phase;       // 'B'egin or 'E'nd
+	long Time;        // ns on CLOCK_MONOTONIC
+};
+typedef struct TraceEvent TraceEvent;
+
+struct TraceBuffer {
+	vector<TraceEvent> Events;
+	const char* ThreadName;
+	int Thread;
+	TraceBuffer* Next;
+};
+typedef struct TraceBuffer TraceBuffer;
+
+/* Every thread's buffer, linked in on its first event and kept after the thread is gone */
+atomic<TraceBuffer*> traceBuffers(NULL);
+atomic<int> traceThreads(0);
+thread_local TraceBuffer* traceBuffer = NULL;
+
+const char* tracePath = "trace.json";
+long traceStart = 0;
+
+long traceTime ()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec*1000000000L + now.tv_nsec;
+}
+
+TraceBuffer* threadTraceBuffer ()
+{
+	if(traceBuffer == NULL)
+	{
+		TraceBuffer* buffer = new TraceBuffer();
+		buffer->ThreadName = NULL;
+		buffer->Thread = traceThreads.fetch_add(1);
+		buffer->Events.reserve(1 << 16);
+		buffer->Next = traceBuffers.load();
+		while(!traceBuffers.compare_exchange_weak(buffer->Next, buffer))
+			;
+		traceBuffer = buffer;
+	}
+	return traceBuffer;
+}
+
+void traceEvent (const char* name, char phase)
+{
+	TraceEvent event = { name, phase, traceTime() };
+	threadTraceBuffer()->Events.push_back(event);
+}
+
+struct TraceScope {
+	const char* Name;
+
+	TraceScope (const char* name) : Name(name) { traceEvent(Name, 'B'); }
+	~TraceScope () { traceEvent(Name, 'E'); }
+};
+
+/* Registered with atexit - every other thread has been joined by then */
+void writeTrace ()
+{
+	FILE* file = fopen(tracePath, "w");
+	if(file == NULL) {
+		cerr << "Could not write trace " << tracePath << endl;
+		return;
+	}
+
+	const char* separator = "";
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	for(TraceBuffer* buffer = traceBuffers.load(); buffer != NULL; buffer = buffer->Next)
+	{
+		if(buffer->ThreadName != NULL) {
+			fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", separator, buffer->Thread, buffer->ThreadName);
+			separator = ",\n";
+		}
+		for(size_t i=0;i<buffer->Events.size();i++)
+		{
+			const TraceEvent &event = buffer->Events[i];
+			fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}", separator, event.Name, event.Phase, (event.Time - traceStart)/1000.0, buffer->Thread);
+			separator = ",\n";
+		}
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_THREAD(name) (threadTraceBuffer()->ThreadName = (name))
+#define TRACE_OUTPUT(path) (tracePath = (path), traceStart = traceTime(), atexit(writeTrace))
+#else
+#define TRACE_SCOPE(name)
+#define TRACE_THREAD(name)
+#define TRACE_OUTPUT(path) ((void)(path))
+#endif
+
+/* Interleaved vertex - position (x,y) and normalized RGBA8 color, 12 bytes */
+struct Vertex {
+	GLfloat x, y;
+	GLubyte color[4];
+};
+typedef struct Vertex Vertex;
+
+/* Vertex of an ellipse quad - starts like Vertex, plus the radii and a second (stripe) color, 24 bytes */
+struct EllipseVertex {
+	GLfloat x, y;
+	GLubyte color[4];
+	GLfloat rx, ry;
+	GLubyte color2[4];
+};
+typedef struct EllipseVertex EllipseVertex;
+
 struct VAO {
 	GLuint VertexArrayID;
-	GLuint VertexBuffer;
-	GLuint ColorBuffer;
+	GLuint VertexBuffer; // Interleaved position + color
+	GLuint InstanceBuffer;
 
 	GLenum PrimitiveMode;
 	GLenum FillMode;
 	int NumVertices;
+	int MaxInstances;
+	int Shader; // FLAT_SHADER or ELLIPSE_SHADER
+
+	// CPU copy of the vertices, for meshes that get transformed on the CPU or baked into a static batch
+	vector<Vertex> Vertices;
+	vector<EllipseVertex> Ellipses;
 };
 typedef struct VAO VAO;
 
+enum { FLAT_SHADER, ELLIPSE_SHADER };
+
 struct GLMatrices {
 	glm::mat4 projection;
 	glm::mat4 model;
 	glm::mat4 view;
-	GLuint MatrixID;
+	GLuint ModelIndexID;        // "ModelIndex" uniform of the flat program
+	GLuint EllipseModelIndexID; // "ModelIndex" uniform of the ellipse program
+	GLuint DepthID;             // "Depth" uniform of the flat program
+	GLuint EllipseDepthID;      // "Depth" uniform of the ellipse program
+	GLuint CameraBuffer;        // std140 Camera block : projection * view
+	GLuint ModelBuffer;         // one mat4 per draw id, read through ModelTexture
+	GLuint ModelTexture;
+	int ModelCapacity;
 } Matrices;
 
-GLuint programID;
+GLuint programID, ellipseProgramID;
 
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
+	TRACE_SCOPE("LoadShaders");
 
 	// Create the shaders
 	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
@@ -117,478 +286,2155 @@ static void error_callback(int error, const char* description)
 	fprintf(stderr, "Error: %s\n", description);
 }
 
+/* Ask the main loop to stop - it joins the simulation thread and prints the stats on the way out */
 void quit(GLFWwindow *window)
 {
-	glfwDestroyWindow(window);
-	glfwTerminate();
-	exit(EXIT_SUCCESS);
+	glfwSetWindowShouldClose(window, GL_TRUE);
 }
 
-float mod(float q)
+
+/* Shadow copy of the GL state the draws touch - calls that would not change anything are skipped */
+struct GLStateCache {
+	GLuint Program;
+	GLuint VertexArray;
+	GLuint ArrayBuffer;
+	GLenum PolygonMode;
+
+	// Calls sent to the driver versus skipped, this frame and since start
+	long Issued, Elided;
+	long TotalIssued, TotalElided;
+	long Frames;
+} glState = { (GLuint)-1, (GLuint)-1, (GLuint)-1, GL_NONE, 0, 0, 0, 0, 0 };
+
+void bindProgram (GLuint program)
 {
-	if(q <= 0)
-		q = q*(-1);
-	return q;
+	if(glState.Program == program) {
+		glState.Elided++;
+		return;
+	}
+	glUseProgram (program);
+	glState.Program = program;
+	glState.Issued++;
 }
 
+void bindVertexArray (GLuint vertex_array)
+{
+	if(glState.VertexArray == vertex_array) {
+		glState.Elided++;
+		return;
+	}
+	glBindVertexArray (vertex_array);
+	glState.VertexArray = vertex_array;
+	glState.Issued++;
+}
 
-/* Generate VAO, VBOs and return VAO handle */
-struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
+void bindArrayBuffer (GLuint buffer)
 {
-	struct VAO* vao = new struct VAO;
-	vao->PrimitiveMode = primitive_mode;
-	vao->NumVertices = numVertices;
-	vao->FillMode = fill_mode;
+	if(glState.ArrayBuffer == buffer) {
+		glState.Elided++;
+		return;
+	}
+	glBindBuffer (GL_ARRAY_BUFFER, buffer);
+	glState.ArrayBuffer = buffer;
+	glState.Issued++;
+}
 
-	// Create Vertex Array Object
-	// Should be done after CreateWindow and before any other GL calls
-	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
-	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
-	glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
+void setPolygonMode (GLenum mode)
+{
+	if(glState.PolygonMode == mode) {
+		glState.Elided++;
+		return;
+	}
+	glPolygonMode (GL_FRONT_AND_BACK, mode);
+	glState.PolygonMode = mode;
+	glState.Issued++;
+}
+
+/* Close the per frame state call counters */
+void endStateFrame ()
+{
+	glState.TotalIssued += glState.Issued;
+	glState.TotalElided += glState.Elided;
+	glState.Frames++;
+	glState.Issued = 0;
+	glState.Elided = 0;
+}
+
+void printStateStats ()
+{
+	if(glState.Frames == 0)
+		return;
+	cout << "GL state calls per frame: issued=" << (double)glState.TotalIssued/glState.Frames;
+	cout << " elided=" << (double)glState.TotalElided/glState.Frames;
+	cout << " (" << glState.Frames << " frames)" << '\n';
+}
+
+/* Convert a [0,1] color channel to a normalized byte */
+GLubyte packColor (GLfloat c)
+{
+	if(c <= 0)
+		return 0;
+	if(c >= 1)
+		return 255;
+	return (GLubyte)(c*255 + 0.5f);
+}
+
+void setVertex (Vertex &v, GLfloat x, GLfloat y, GLfloat red, GLfloat green, GLfloat blue)
+{
+	v.x = x;
+	v.y = y;
+	v.color[0] = packColor(red);
+	v.color[1] = packColor(green);
+	v.color[2] = packColor(blue);
+	v.color[3] = 255;
+}
 
-	glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
+/* Point attributes 0 (position) and 1 (color) of the bound VAO at an interleaved Vertex buffer */
+void setVertexAttributes (GLuint first_attribute, GLsizei stride=sizeof(Vertex))
+{
 	glVertexAttribPointer(
-			0,                  // attribute 0. Vertices
-			3,                  // size (x,y,z)
+			first_attribute,    // attribute 0. Vertices
+			2,                  // size (x,y)
 			GL_FLOAT,           // type
 			GL_FALSE,           // normalized?
-			0,                  // stride
+			stride,             // stride
 			(void*)0            // array buffer offset
 			);
+	glVertexAttribPointer(
+			first_attribute+1,  // attribute 1. Color
+			4,                  // size (r,g,b,a)
+			GL_UNSIGNED_BYTE,   // type
+			GL_TRUE,            // normalized?
+			stride,             // stride
+			(void*)(2*sizeof(GLfloat)) // array buffer offset
+			);
+	glEnableVertexAttribArray(first_attribute);
+	glEnableVertexAttribArray(first_attribute+1);
+}
 
-	glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
-	glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
+/* Point attributes 0, 1, 4 (radii) and 5 (stripe color) of the bound VAO at an EllipseVertex buffer */
+void setEllipseAttributes (GLsizei stride)
+{
+	setVertexAttributes(0, stride);
 	glVertexAttribPointer(
-			1,                  // attribute 1. Color
-			3,                  // size (r,g,b)
+			4,                  // attribute 4. Radii
+			2,                  // size (rx,ry)
 			GL_FLOAT,           // type
 			GL_FALSE,           // normalized?
-			0,                  // stride
-			(void*)0            // array buffer offset
+			stride,             // stride
+			(void*)(2*sizeof(GLfloat) + 4) // array buffer offset
 			);
-
-	return vao;
+	glVertexAttribPointer(
+			5,                  // attribute 5. Stripe color
+			4,                  // size (r,g,b,a)
+			GL_UNSIGNED_BYTE,   // type
+			GL_TRUE,            // normalized?
+			stride,             // stride
+			(void*)(4*sizeof(GLfloat) + 4) // array buffer offset
+			);
+	glEnableVertexAttribArray(4);
+	glEnableVertexAttribArray(5);
 }
 
-
-/* Render the VBOs handled by VAO */
-void draw3DObject (struct VAO* vao)
+/* Generate VAO, VBO and return VAO handle */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const Vertex* vertices, GLenum fill_mode=GL_FILL)
 {
-	// Change the Fill Mode for this object
-	glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
-
-	// Bind the VAO to use
-	glBindVertexArray (vao->VertexArrayID);
+	TRACE_SCOPE("create3DObject");
+	struct VAO* vao = new struct VAO;
+	vao->PrimitiveMode = primitive_mode;
+	vao->NumVertices = numVertices;
+	vao->FillMode = fill_mode;
+	vao->InstanceBuffer = 0;
+	vao->MaxInstances = 0;
+	vao->Shader = FLAT_SHADER;
 
-	// Enable Vertex Attribute 0 - 3d Vertices
-	glEnableVertexAttribArray(0);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+	// Create Vertex Array Object
+	// Should be done after CreateWindow and before any other GL calls
+	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices and colors
 
-	// Enable Vertex Attribute 1 - Color
-	glEnableVertexAttribArray(1);
-	// Bind the VBO to use
-	glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+	bindVertexArray (vao->VertexArrayID); // Bind the VAO 
+	bindArrayBuffer (vao->VertexBuffer); // Bind the VBO vertices 
+	glBufferData (GL_ARRAY_BUFFER, numVertices*sizeof(Vertex), vertices, GL_STATIC_DRAW); // Copy the vertices into VBO
+	setVertexAttributes(0);
+	vao->Vertices.assign(vertices, vertices + numVertices);
 
-	// Draw the geometry !
-	glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+	return vao;
 }
 
-/**************************
- * Customizable functions *
- **************************/
-float triangle_rot_dir = 1;
-float rectangle_rot_dir = 1;
-bool triangle_rot_status = true;
-bool rectangle_rot_status = true;
-float teta = 30;
-float triangle_rotation = 0;
-float rectangle_rotation = 30;
-float x = -840.0f + 200 * cos(DEG2RAD(teta));//*(0.5) + (250 * cos(DEG2RAD(teta)) * (0.5));
-float y = -140.f + 220 * sin(DEG2RAD(teta));// * (0.8) + (220 * sin(DEG2RAD(teta)) * (0.4));
-float u = 100;
-float inipig3ver = 80;
-int flag =0;
-int speednotsuff = 0;
-int timesparks = 0;
-float z = 0;
-float t = 0;
-float r = 0;
-float prevu;
-int lifes = 0;
-float tetacannon = 30;
-int checkonce8 = 0;
-int checkonce7 = 0;
-int checkonce7hor = 0;
-int checkonce6 = 0;
-float ang = 0;
-int yay2 = 0;
-int block9fall = 0;
-int checkonce11 = 0;
-int yes = 0;
-int reboundfromright = 0;
-float camera_rotation_angle = 90;
-float circle_rotation = 0;
-float horblock,vertblock;
-float pig6collisioncomplete = 0;
-int width = 1600;
-int yay = 0;
-int block10fall = 0;
-float iniblock9 = 450.0f;
-float iniblock10 = 650.0f;
-int height = 800;
-float q,p;
-float timedur = 0;
-int pig5birdcollide = 0;
-int pig5collisioncomplete = 0;
-int pig5flag =0;
-int checkonce10 = 0;
-float iniproy9 = 0,iniproy10 = 0;
-float currenttime = 0;
-int flaggyfally = 0;
-float starttime = 0;
-float iniblock9ver = 40.0f;
-float inipig5ver = 75.0f;
-int times2 = 0;
-float smokex = -670,smokey = 275;
-int basegone = 0;
-int cominghere = 0;
-int lifeflag = 0;
-VAO *block3,*lifecircle;
-int pig5flag2 = 0;
-float checkonce9 = 0;
-float firsttimez = 0;
-int times = 0;
-int pig6collide = 0;
-float lefthor = -1000.0f;
-float block9_rotate = 0;
-float righthor = 1000.0f;
-float zoomie = 1;
-float vertup = 500.0f;
-int pig3collide = 0;
-float vertdown = -500.f;
-float inipig6hor = 300.0f;
-float checkonce7hor2 = 0;
-int checkonce4hor3 = 0;
-int checkonce12 = 0;
-int checkonce13 = 0;
-int checkonce4hor4 = 0;
-float inipig6ver = -120.0f;
-float inipig2hor = 650;
-int pig3birdcollide = 0;
-int times3 = 0;
-int times4 = 0;
-
-float inipig2ver = 220;
-float iniblock11 = 400.0f;
-float iniblock11ver = 150.0f;
-int block9died = 0;
-int block10died = 0;
-int checkonce4hor2 = 0;
-float block10_rotate = 0;
-float e =1;
-int pig2collide = 0;
-int pig7collide = 0;
-int checkonce82 = 0;
-float horiu;
-int count = 0;
-float zoo = 0;
-int pig3collisioncomplete = 0;
-float xpig5 = 820.0f;
-int pig7disappear = 0;
-int checkonce4 = 0;
-float block7_rotation = 0;
-int pig4collide = 0;
-float inipig4hor = 370.0f;
-float inipig4ver = 70.0f;
-float smokehor = 0.5,smokever = 0.5;
-float xpig3=570.0f;
-float pig3flag =0;
-int score = 0;
-float times9 = 0;
-VAO *speedrect;
-int flaggy9 = 0;
-int flaggy10 = 0;
-float t10;
-float times10 = 0;
-int block9finish = 0;
-int timescheck = 0;
-float tlast = 0;
-float t9 = 0;
-float iniblock10ver = 40;
-int times6 = 0,times5 = 0,pig5collide = 0;
-int block10finish = 0;
-int block10collide = 0;
-float circle_rot_dir = 1;
-bool circle_rot_status =true;
-/* Executed when a regular key is pressed/released/held-down */
-/* Prefered for Keyboard events */
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+/* Generate VAO, VBO and return VAO handle - separate x,y,z and r,g,b arrays, z is dropped */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
 {
-	// Function is called first on GLFW_PRESS.
+	TRACE_SCOPE("create3DObject");
+	vector<Vertex> vertices(numVertices);
+	for (int i=0; i<numVertices; i++)
+		setVertex(vertices[i], vertex_buffer_data[3*i], vertex_buffer_data[3*i + 1], color_buffer_data[3*i], color_buffer_data[3*i + 1], color_buffer_data[3*i + 2]);
 
-	if (action == GLFW_REPEAT || action == GLFW_PRESS) {
-		switch (key) {
-			case GLFW_KEY_A:
-				if(flag == 0 && teta < 80)
-				{
-					rectangle_rotation = rectangle_rotation + 2;
-					tetacannon = tetacannon + 2;
-					teta = tetacannon;
-					/*	if(tetacannon == 0){
-						x = x-2;
-						y = -136.f;}
-						else
-						{*/
-					x = -840.0f + 200 * cos(DEG2RAD(teta));//*(0.5) + (250 * cos(DEG2RAD(teta)) * (0.5)); 
-					y = -140.f + 220 * sin(DEG2RAD(teta));
-					if(tetacannon < 0)
-						y = -140.f + 180 * sin(DEG2RAD(teta));//* (0.8) + (220 * sin(DEG2RAD(teta)) * (0.4));
-					else if(tetacannon > 0 && tetacannon <= 10)
-						y = -140.f + 280 * sin(DEG2RAD(tetacannon));
-					//}
-				}
-				break;
-			case GLFW_KEY_B:
+	return create3DObject(primitive_mode, numVertices, &vertices[0], fill_mode);
+}
 
-				if(flag == 0 && teta > -10)
-				{
-					rectangle_rotation = rectangle_rotation - 2;
-					tetacannon = tetacannon - 2;
-					teta = tetacannon;
-					/*if(tetacannon == 0){
-					  x = x-2;
-					  y = -133.f;}
-					  else
-					  {*/	
-					x = -840.0f + 200 * cos(DEG2RAD(tetacannon));//*(0.5) + (250 * cos(DEG2RAD(teta)) * (0.5)); 
-					y = -140.f + 220 * sin(DEG2RAD(tetacannon));
-					if(tetacannon < 0)
-						y = -140.f + 180 * sin(DEG2RAD(tetacannon));//* (0.8) + (220 * sin(DEG2RAD(teta)) * (0.4));
-					else if(tetacannon > 0 && tetacannon <= 10)
-						y = -140.f + 280 * sin(DEG2RAD(tetacannon));
-					//}
-				}
-				//canon should go down
-				break;
-			case GLFW_KEY_SPACE:
-				if(flag == 0)
-				{
-					flag = 1;
-					checkonce6 = 0;
-					checkonce8 = 0;
-					times = 0;
-					prevu = u;
-					teta = tetacannon;	
-					/*if(tetacannon == 0){
-					  x = x-2;
-					  y = -133.f;}
-					  else
-					  {*/
-
-					x = -840.0f + 200 * cos(DEG2RAD(tetacannon));//*(0.5) + (250 * cos(DEG2RAD(teta)) * (0.5)); 
-					y = -140.f + 220 * sin(DEG2RAD(tetacannon));
-					if(tetacannon < 0)
-						y = -140.f + 180 * sin(DEG2RAD(tetacannon));//* (0.8) + (220 * sin(DEG2RAD(teta)) * (0.4));
-					else if(tetacannon > 0 && tetacannon <= 10)
-						y = -140.f + 280 * sin(DEG2RAD(tetacannon));
-					//	}
-					z=0;
-					r = 0;
-					t = 0;
-				}
-				break;
-			case GLFW_KEY_F:
-				if(flag == 0){
-					if(u< 200)
-						u = u+5;	
 
-				}
-				break;
-			case GLFW_KEY_S:
-				if(flag == 0){
-					if(u>=5)
-						u = u-5;
-				}
-				break;
+/* Generate VAO, VBO and return VAO handle - ellipse vertices, drawn with the ellipse shader */
+struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const EllipseVertex* vertices, GLenum fill_mode=GL_FILL)
+{
+	TRACE_SCOPE("create3DObject");
+	struct VAO* vao = new struct VAO;
+	vao->PrimitiveMode = primitive_mode;
+	vao->NumVertices = numVertices;
+	vao->FillMode = fill_mode;
+	vao->InstanceBuffer = 0;
+	vao->MaxInstances = 0;
+	vao->Shader = ELLIPSE_SHADER;
 
-			case GLFW_KEY_LEFT:
-				if(lefthor > -2000)
-				{	
-					//             circle_rot_status = !circle_rot_status;
-					lefthor = lefthor-50;
-					righthor = righthor - 50;
-				}
-				break;
-			case GLFW_KEY_RIGHT:
-				// do something ..
-				if(righthor < 2000){
-					lefthor = lefthor + 50;
-					righthor = righthor + 50;
-				}
-				break;
-			case GLFW_KEY_UP:
-				if( zoomie > 0.5){
-					zoomie = zoomie - 0.1;
-					vertup = vertup + 30;
-					vertdown = vertdown - 30;
-					lefthor = lefthor - 60;
-					righthor = righthor + 60;
-					//left = left * zoomie;
-					//right = right * zoomie;
-					//	lefthor = lefthor + left;
-					//	righthor = righthor + right;
-
-				}	
-				break;
-			case GLFW_KEY_DOWN:
-				if(zoomie < 1.5)
-				{	
-					zoomie = zoomie + 0.1;
-					vertup = vertup - 30;
-					vertdown = vertdown + 30;
-					lefthor = lefthor + 60;
-					righthor = righthor - 60 ;
-					//	lefthor = lefthor + left;
-					//	righthor = righthor + right;	
-					//       rectangle_rot_status = !rectangle_rot_status;
-				}
-			default:
-				break;
-		}
-	}
-	else if (action == GLFW_RELEASE) {
-		switch (key) {
+	glGenVertexArrays(1, &(vao->VertexArrayID)); // VAO
+	glGenBuffers (1, &(vao->VertexBuffer)); // VBO - corners, colors and radii
 
-			break;
-			case GLFW_KEY_SPACE:
-			starttime = glfwGetTime();
-			break;
-			case GLFW_KEY_ESCAPE:
-			quit(window);
-			break;
-			default:
-			break;
-		}
-	}
+	bindVertexArray (vao->VertexArrayID); // Bind the VAO
+	bindArrayBuffer (vao->VertexBuffer); // Bind the VBO vertices
+	glBufferData (GL_ARRAY_BUFFER, numVertices*sizeof(EllipseVertex), vertices, GL_STATIC_DRAW); // Copy the vertices into VBO
+	setEllipseAttributes(sizeof(EllipseVertex));
+	vao->Ellipses.assign(vertices, vertices + numVertices);
+
+	return vao;
 }
 
-/* Executed for character input (like in text boxes) */
-void keyboardChar (GLFWwindow* window, unsigned int key)
+/* Generate an ellipse as a single quad drawn with the ellipse shader - the edge is computed per fragment */
+struct VAO* createEllipseObject (GLfloat rad1, GLfloat rad2, GLfloat red, GLfloat green, GLfloat blue, GLfloat red2, GLfloat green2, GLfloat blue2)
 {
-	switch (key) {
-		case 'Q':
-		case 'q':
-			quit(window);
-			break;
-		default:
-			break;
+	TRACE_SCOPE("createEllipseObject");
+	// Pad the quad a little so the anti-aliased edge is not clipped
+	GLfloat w = rad1 + 4;
+	GLfloat h = rad2 + 4;
+	const GLfloat corners [] = {
+		-w,-h, // vertex 1
+		w,-h, // vertex 2
+		-w,h, // vertex 3
+		w,h  // vertex 4
+	};
+
+	EllipseVertex vertices [4];
+	for (int i=0; i<4; i++) {
+		Vertex v;
+		setVertex(v, corners[2*i], corners[2*i + 1], red, green, blue);
+		vertices[i].x = v.x;
+		vertices[i].y = v.y;
+		vertices[i].rx = rad1;
+		vertices[i].ry = rad2;
+		for (int c=0; c<4; c++)
+			vertices[i].color[c] = v.color[c];
+		setVertex(v, 0, 0, red2, green2, blue2);
+		for (int c=0; c<4; c++)
+			vertices[i].color2[c] = v.color[c];
 	}
+
+	return create3DObject(GL_TRIANGLE_STRIP, 4, vertices);
 }
 
-float mousex,mousey,radi;
-/* Executed when a mouse button is pressed/released */
-void mouseButton (GLFWwindow* window, int button, int action, int mods)
+/* Attach a per-instance buffer to the VAO - 5 floats per instance: offset (x,y) and tint (r,g,b) */
+void createInstanceBuffer (struct VAO* vao, int maxInstances, const GLfloat* instance_buffer_data)
 {
-	switch (button) {
-		case GLFW_MOUSE_BUTTON_LEFT:
+	TRACE_SCOPE("createInstanceBuffer");
+	vao->MaxInstances = maxInstances;
 
-			if (action == GLFW_RELEASE)
-			{
-				if(flag == 0){
-					if(u < 200)
-						u = u+5;	
-				}
+	// Instances use the same packed layout as vertices : offset in place of position, tint in place of color
+	vector<Vertex> instances(maxInstances);
+	for (int i=0; i<maxInstances; i++)
+		setVertex(instances[i], instance_buffer_data[5*i], instance_buffer_data[5*i + 1], instance_buffer_data[5*i + 2], instance_buffer_data[5*i + 3], instance_buffer_data[5*i + 4]);
 
-			}
+	glGenBuffers (1, &(vao->InstanceBuffer)); // VBO - per instance offset and tint
 
+	bindVertexArray (vao->VertexArrayID); // Bind the VAO
+	bindArrayBuffer (vao->InstanceBuffer); // Bind the VBO instances
+	glBufferData (GL_ARRAY_BUFFER, maxInstances*sizeof(Vertex), &instances[0], GL_STATIC_DRAW); // Copy the instances into VBO
+	setVertexAttributes(2);
 
+	// Advance attributes 2 and 3 once per instance instead of once per vertex
+	glVertexAttribDivisor(2, 1);
+	glVertexAttribDivisor(3, 1);
+}
 
+/* Streaming vertex ring - moving objects are transformed on the CPU and written here every frame.
+ * The buffer is split in STREAM_SLICES frame slices; a slice is only written again once the fence
+ * placed after its draws has signalled, so mapping it unsynchronized never races the GPU */
+#define STREAM_SLICES 3
 
-			// triangle
-			break;
-		case GLFW_MOUSE_BUTTON_RIGHT:
-			if (action == GLFW_RELEASE) {
-				if(flag == 0)
-				{
-					if(u >= 5)
-					{
-						u = u-5;
-					}
-				}
+/* Streamed ellipse vertex - the corner stays in ellipse space for the distance test,
+ * the per vertex offset (attribute 2) carries it to its place in the world */
+struct StreamEllipseVertex {
+	EllipseVertex Quad;
+	GLfloat ox, oy;
+};
+typedef struct StreamEllipseVertex StreamEllipseVertex;
+
+struct StreamBuffer {
+	GLuint Buffer;
+	GLuint FlatArray;    // VAO reading the ring as Vertex
+	GLuint EllipseArray; // VAO reading the ring as StreamEllipseVertex
+	GLsizeiptr SliceSize;
+	int Slice;
+	GLsizeiptr Head;     // next free byte in the current slice
+	GLubyte* Mapped;     // current slice while it is being written, NULL otherwise
+	GLsync Fences[STREAM_SLICES];
+
+	// Bytes written and seconds spent waiting on fences, this frame and since start
+	long Bytes, TotalBytes;
+	double Wait, TotalWait;
+	long Frames;
+} stream;
+
+void createStreamBuffer (GLsizeiptr sliceSize)
+{
+	TRACE_SCOPE("createStreamBuffer");
+	stream.SliceSize = sliceSize;
+	stream.Slice = 0;
+	stream.Head = 0;
+	stream.Mapped = NULL;
+	for (int i=0; i<STREAM_SLICES; i++)
+		stream.Fences[i] = 0;
+	stream.Bytes = stream.TotalBytes = 0;
+	stream.Wait = stream.TotalWait = 0;
+	stream.Frames = 0;
+
+	glGenBuffers (1, &(stream.Buffer)); // VBO - every slice back to back
+	bindArrayBuffer (stream.Buffer);
+	glBufferData (GL_ARRAY_BUFFER, STREAM_SLICES*sliceSize, NULL, GL_STREAM_DRAW);
+
+	// One VAO per vertex format, both over the whole ring - draws pick their slice with the first vertex
+	glGenVertexArrays (1, &(stream.FlatArray));
+	bindVertexArray (stream.FlatArray);
+	setVertexAttributes(0);
+
+	glGenVertexArrays (1, &(stream.EllipseArray));
+	bindVertexArray (stream.EllipseArray);
+	setEllipseAttributes(sizeof(StreamEllipseVertex));
+	glVertexAttribPointer(
+			2,                  // attribute 2. Offset
+			2,                  // size (x,y)
+			GL_FLOAT,           // type
+			GL_FALSE,           // normalized?
+			sizeof(StreamEllipseVertex), // stride
+			(void*)sizeof(EllipseVertex) // array buffer offset
+			);
+	glEnableVertexAttribArray(2);
+}
 
-			}
-			break;
+/* Move to the next slice, wait until the GPU is done with it and map it for writing */
+void beginStreamFrame ()
+{
+	stream.Slice = (stream.Slice + 1) % STREAM_SLICES;
+	stream.Head = 0;
 
-		default:
-			break;
+	GLsync fence = stream.Fences[stream.Slice];
+	if(fence)
+	{
+		double start = clockTime();
+		GLenum result = glClientWaitSync(fence, 0, 0);
+		while(result == GL_TIMEOUT_EXPIRED)
+			result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000); // 1ms
+		stream.Wait += clockTime() - start;
+		glDeleteSync(fence);
+		stream.Fences[stream.Slice] = 0;
 	}
+
+	bindArrayBuffer (stream.Buffer);
+	stream.Mapped = (GLubyte*)glMapBufferRange(GL_ARRAY_BUFFER, stream.Slice*stream.SliceSize, stream.SliceSize,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
 }
-/*void mouse(GLFWwindow* window,double x,double y)
-  {
-  mousex = float(x / zoomie);
-  mousey = float(y / zoomie);//(-1) * (float(y)-500);
-  cout << "mousex " << mousex << '\n';
-  cout << mousey << '\n';
-  radi = atan((mousey + 140)/(mousex + 840));
-  if(RAD2DEG(radi) < 80 && RAD2DEG(radi) > -10){
-  tetacannon = tetacannon + RAD2DEG(radi);
-  rectangle_rotation = tetacannon;
-  teta = tetacannon;
 
-  x = -840.0f + 200 * cos(DEG2RAD(tetacannon));//*(0.5) + (250 * cos(DEG2RAD(teta)) * (0.5)); 
-  y = -140.f + 220 * sin(DEG2RAD(tetacannon));
-  if(tetacannon < 0)
-  y = -140.f + 180 * sin(DEG2RAD(tetacannon));//* (0.8) + (220 * sin(DEG2RAD(teta)) * (0.4));
-  else if(tetacannon > 0 && tetacannon <= 10)
-  y = -140.f + 280 * sin(DEG2RAD(tetacannon));
-  }
-  }*/		
+/* Reserve count vertices of the given size in the current slice - returns where to write them, NULL if the slice is full.
+ * The start is aligned to the vertex size, so the draw can address it as first = offset / stride */
+void* streamAlloc (int count, GLsizei stride, GLint *first)
+{
+	if(stream.Mapped == NULL)
+		return NULL;
+
+	GLsizeiptr base = stream.Slice*stream.SliceSize;
+	GLsizeiptr start = (base + stream.Head + stride-1) / stride * stride;
+	GLsizeiptr size = (GLsizeiptr)count*stride;
+	if(start + size > base + stream.SliceSize)
+		return NULL;
+
+	stream.Head = start + size - base;
+	stream.Bytes += size;
+	*first = start / stride;
+	return stream.Mapped + (start - base);
+}
 
+/* Done writing this frame - the slice has to be unmapped before anything draws from it */
+void endStreamWrites ()
+{
+	if(stream.Mapped == NULL)
+		return;
+	bindArrayBuffer (stream.Buffer);
+	glUnmapBuffer (GL_ARRAY_BUFFER);
+	stream.Mapped = NULL;
+}
 
-void scrollback(GLFWwindow* window,double x,double y)
+/* Fence the slice after its last draw and close the per frame counters */
+void endStreamFrame ()
 {
-	zoo = float(y)/10;
-	if(zoo >= 0)
-	{
-		if( zoomie > 0.5){
-			zoomie = zoomie - 0.1;
-			vertup = vertup + 30;
-			vertdown = vertdown - 30;
-			lefthor = lefthor - 60;
-			righthor = righthor + 60;
-			//left = left * zoomie;
-			//right = right * zoomie;
-			//	lefthor = lefthor + left;
-			//	righthor = righthor + right;
-
-		}	
-	}
-	else if(zoo < 0){
-		if(zoomie < 1.5)
-		{	
-			zoomie = zoomie + 0.1;
-			vertup = vertup - 30;
-			vertdown = vertdown + 30;
-			lefthor = lefthor + 60;
-			righthor = righthor - 60 ;
-			//	lefthor = lefthor + left;
-			//	righthor = righthor + right;	
-			//       rectangle_rot_status = !rectangle_rot_status;
-		}
-	}
+	endStreamWrites();
+	if(stream.Fences[stream.Slice])
+		glDeleteSync(stream.Fences[stream.Slice]);
+	stream.Fences[stream.Slice] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+	stream.TotalBytes += stream.Bytes;
+	stream.TotalWait += stream.Wait;
+	stream.Frames++;
+	stream.Bytes = 0;
+	stream.Wait = 0;
 }
 
-/* Executed when window is resized to 'width' and 'height' */
-/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
-void reshapeWindow (GLFWwindow* window, int width, int height)
+void printStreamStats ()
 {
-	int fbwidth=width, fbheight=height;
+	if(stream.Frames == 0)
+		return;
+	cout << "Stream buffer per frame: bytes=" << (double)stream.TotalBytes/stream.Frames;
+	cout << " fence wait=" << stream.TotalWait*1000/stream.Frames << "ms";
+	cout << " (" << stream.Frames << " frames)" << '\n';
+}
+
+/* Where an object is at the end of a simulation tick */
+struct EntityState {
+	float X, Y;
+	float Rotation;
+	float ScaleX, ScaleY;
+	bool Visible;
+	bool Snap; // jumped there this tick - drawn as is, not blended from the last one
+};
+typedef struct EntityState EntityState;
+
+/* One row of the render table - draw() walks these in order */
+struct Entity {
+	VAO* Mesh;
+
+	// Transform drawn this frame : translate (X,Y), rotate by Rotation degrees about z, scale (ScaleX,ScaleY)
+	float X, Y;
+	float Rotation;
+	float ScaleX, ScaleY;
+
+	bool Visible;
+	bool Dirty; // model matrix is stale and has to be rebuilt before drawing
+
+	// Moving objects go through the sprite batch instead of using their model matrix
+	bool Streamed;
+};
+typedef struct Entity Entity;
+
+vector<Entity> entities;
+
+/* Simulation side of the table - every entity as of the last two ticks */
+vector<EntityState> entityPrevious, entityCurrent;
+
+/* Append an object to the render table and return its id */
+int addEntity (struct VAO* mesh, float x, float y, float rotation=0, float scalex=1, float scaley=1)
+{
+	Entity entity;
+	entity.Mesh = mesh;
+	entity.X = x;
+	entity.Y = y;
+	entity.Rotation = rotation;
+	entity.ScaleX = scalex;
+	entity.ScaleY = scaley;
+	entity.Visible = true;
+	entity.Dirty = true;
+	entity.Streamed = false;
+
+	EntityState state = { x, y, rotation, scalex, scaley, true, false };
+	entityPrevious.push_back(state);
+	entityCurrent.push_back(state);
+
+	entities.push_back(entity);
+	return entities.size()-1;
+}
+
+/* Move an object at the current tick */
+void setEntityTransform (int id, float x, float y, float rotation=0, float scalex=1, float scaley=1)
+{
+	EntityState &state = entityCurrent[id];
+	state.X = x;
+	state.Y = y;
+	state.Rotation = rotation;
+	state.ScaleX = scalex;
+	state.ScaleY = scaley;
+}
+
+void setEntityVisible (int id, bool visible)
+{
+	entityCurrent[id].Visible = visible;
+}
+
+/* The object was put where it is this tick rather than moving there, so there is nothing to interpolate */
+void snapEntity (int id)
+{
+	entityCurrent[id].Snap = true;
+}
+
+/* Start a tick - what was current becomes the state we interpolate from */
+void beginEntityTick ()
+{
+	entityPrevious = entityCurrent;
+	for(int i=0;i<(int)entityCurrent.size();i++)
+		entityCurrent[i].Snap = false;
+}
+
+/* Place every object alpha of the way between two ticks.
+ * The cached model matrix is only invalidated if something actually changed */
+void interpolateEntities (const vector<EntityState> &previous, const vector<EntityState> &current, float alpha)
+{
+	for(int i=0;i<(int)entities.size();i++)
+	{
+		Entity &entity = entities[i];
+		const EntityState &b = current[i];
+		const EntityState &a = b.Snap ? b : previous[i];
+		float x = a.X + (b.X - a.X)*alpha;
+		float y = a.Y + (b.Y - a.Y)*alpha;
+		float rotation = a.Rotation + (b.Rotation - a.Rotation)*alpha;
+		float scalex = a.ScaleX + (b.ScaleX - a.ScaleX)*alpha;
+		float scaley = a.ScaleY + (b.ScaleY - a.ScaleY)*alpha;
+
+		entity.Visible = b.Visible;
+		if(entity.X == x && entity.Y == y && entity.Rotation == rotation && entity.ScaleX == scalex && entity.ScaleY == scaley)
+			continue;
+
+		entity.X = x;
+		entity.Y = y;
+		entity.Rotation = rotation;
+		entity.ScaleX = scalex;
+		entity.ScaleY = scaley;
+		entity.Dirty = true;
+	}
+}
+
+void setEntityStreamed (int id)
+{
+	entities[id].Streamed = true;
+}
+
+/* Model matrix of every draw id - 0 is identity, entity i uses i+1 */
+vector<glm::mat4> modelMatrices;
+
+/* Camera and model transforms live in buffers, so each frame costs two buffer updates instead of a matrix upload per object */
+void createTransformBuffers ()
+{
+	TRACE_SCOPE("createTransformBuffers");
+	glGenBuffers (1, &(Matrices.CameraBuffer));
+	glBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+	glBufferData (GL_UNIFORM_BUFFER, sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+	glBindBufferBase (GL_UNIFORM_BUFFER, 0, Matrices.CameraBuffer); // binding point 0 : Camera
+
+	glGenBuffers (1, &(Matrices.ModelBuffer));
+	glGenTextures (1, &(Matrices.ModelTexture));
+	Matrices.ModelCapacity = 0;
+	modelMatrices.assign(1, glm::mat4(1.0f));
+}
+
+/* Upload projection * view - once per frame, shared by both programs */
+void updateCameraBuffer (const glm::mat4 &VP)
+{
+	glBindBuffer (GL_UNIFORM_BUFFER, Matrices.CameraBuffer);
+	glBufferSubData (GL_UNIFORM_BUFFER, 0, sizeof(glm::mat4), &VP[0][0]);
+}
+
+/* Rebuild the model matrices of entities that moved and upload the changed range in one go */
+void updateModelBuffer ()
+{
+	int count = entities.size() + 1;
+	int first = count, last = 0;
+
+	// More entities than the buffer holds - grow it and send everything
+	if(count > Matrices.ModelCapacity)
+	{
+		Matrices.ModelCapacity = count;
+		modelMatrices.resize(count, glm::mat4(1.0f));
+		glBindBuffer (GL_TEXTURE_BUFFER, Matrices.ModelBuffer);
+		glBufferData (GL_TEXTURE_BUFFER, count*sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+		glActiveTexture (GL_TEXTURE0);
+		glBindTexture (GL_TEXTURE_BUFFER, Matrices.ModelTexture);
+		glTexBuffer (GL_TEXTURE_BUFFER, GL_RGBA32F, Matrices.ModelBuffer); // one column per texel
+		first = 0;
+		last = count-1;
+	}
+
+	for(int i=0;i<(int)entities.size();i++)
+	{
+		Entity &entity = entities[i];
+		if(!entity.Dirty)
+			continue;
+
+		glm::mat4 translateEntity = glm::translate (glm::vec3(entity.X, entity.Y, 0.0f)); // glTranslatef
+		glm::mat4 rotateEntity = glm::rotate((float)(entity.Rotation*M_PI/180.0f), glm::vec3(0,0,1));
+		glm::mat4 scaleEntity = glm::scale (glm::vec3(entity.ScaleX, entity.ScaleY, 1));
+		modelMatrices[i+1] = translateEntity * rotateEntity * scaleEntity;
+		entity.Dirty = false;
+
+		first = min(first, i+1);
+		last = max(last, i+1);
+	}
+
+	if(first > last)
+		return;
+	glBindBuffer (GL_TEXTURE_BUFFER, Matrices.ModelBuffer);
+	glBufferSubData (GL_TEXTURE_BUFFER, first*sizeof(glm::mat4), (last-first+1)*sizeof(glm::mat4), &modelMatrices[first][0][0]);
+}
+
+/* Scenery that never moves - baked into world space once instead of being drawn object by object.
+ * The full screen backgrounds get a batch of their own so they can be drawn after everything else */
+vector<Entity> staticEntities, backgroundEntities;
+VAO *staticBatch, *staticEllipseBatch;
+VAO *backgroundBatch, *backgroundEllipseBatch;
+
+/* Queue an object for the static batch - only translation is supported */
+void addStaticEntity (struct VAO* mesh, float x, float y, bool background=false)
+{
+	Entity entity;
+	entity.Mesh = mesh;
+	entity.X = x;
+	entity.Y = y;
+	entity.Rotation = 0;
+	entity.ScaleX = 1;
+	entity.ScaleY = 1;
+	entity.Visible = true;
+	entity.Dirty = false;
+	entity.Streamed = false;
+
+	if(background)
+		backgroundEntities.push_back(entity);
+	else
+		staticEntities.push_back(entity);
+}
+
+/* Merge the queued static objects into one triangle list per shader, in queue order - a batch is NULL if it would be empty */
+void createStaticBatch (const vector<Entity> &queue, VAO* &batch, VAO* &ellipseBatch)
+{
+	TRACE_SCOPE("createStaticBatch");
+	vector<Vertex> vertices;
+	vector<EllipseVertex> ellipses;
+	vector<Vertex> ellipseOffsets;
+
+	for(int i=0;i<(int)queue.size();i++)
+	{
+		const Entity &entity = queue[i];
+		VAO* mesh = entity.Mesh;
+
+		if(mesh->Shader == FLAT_SHADER)
+		{
+			// Triangle lists can simply be appended in world space
+			for(int v=0;v<(int)mesh->Vertices.size();v++)
+			{
+				Vertex vertex = mesh->Vertices[v];
+				vertex.x += entity.X;
+				vertex.y += entity.Y;
+				vertices.push_back(vertex);
+			}
+		}
+		else
+		{
+			// The ellipse shader needs corners relative to the center, so the center
+			// travels in a per-vertex offset stream and the strip becomes two triangles
+			const int strip_to_triangles [] = { 0,1,2, 2,1,3 };
+			for(int v=0;v<6;v++)
+			{
+				Vertex offset;
+				setVertex(offset, entity.X, entity.Y, 1, 1, 1);
+				ellipses.push_back(mesh->Ellipses[strip_to_triangles[v]]);
+				ellipseOffsets.push_back(offset);
+			}
+		}
+	}
+
+	batch = NULL;
+	if(!vertices.empty())
+		batch = create3DObject(GL_TRIANGLES, vertices.size(), &vertices[0], GL_FILL);
+
+	ellipseBatch = NULL;
+	if(ellipses.empty())
+		return;
+	ellipseBatch = create3DObject(GL_TRIANGLES, ellipses.size(), &ellipses[0], GL_FILL);
+	glGenBuffers (1, &(ellipseBatch->InstanceBuffer)); // VBO - per vertex center, divisor stays 0
+	bindArrayBuffer (ellipseBatch->InstanceBuffer);
+	glBufferData (GL_ARRAY_BUFFER, ellipseOffsets.size()*sizeof(Vertex), &ellipseOffsets[0], GL_STATIC_DRAW);
+	setVertexAttributes(2);
+}
+
+/* Rigid bodies - convex polygons and circles pushed apart by contact impulses.
+ * Contacts are found again every step and solved with sequential impulses, so the tower
+ * stacks, tips over and gets knocked about the same way whatever hits it.
+ * Units are the game's : pixels, and the flight time of SHOT_TIME_STEP per 60Hz tick */
+#define MAX_POLYGON_VERTICES 8
+
+#define GRAVITY 9.8f
+#define SOLVER_ITERATIONS 10
+/* Contacts are made this far out, so bodies resting on each other stay in touch */
+#define CONTACT_MARGIN 2.0f
+/* Overlap that is left alone, and the share of the rest pushed out per step */
+#define PENETRATION_SLOP 0.5f
+#define BAUMGARTE 0.2f
+/* Contacts closing slower than this are resting ones - they do not bounce, and what they take is not an impact */
+#define RESTITUTION_SPEED 5.0f
+#define LINEAR_DAMPING 0.02f
+#define ANGULAR_DAMPING 0.1f
+/* Most contacts a bullet stops at within one step - past that it waits for the next step */
+#define MAX_SUBSTEPS 4
+/* Bodies that stay slower than SLEEP_SPEED for SLEEP_TIME, with everything awake they touch, go to rest */
+#define SLEEP_SPEED 1.0f
+#define SLEEP_TIME 1.0f
+
+enum { SHAPE_CIRCLE, SHAPE_POLYGON };
+
+struct Body {
+	int Shape;
+	float Radius;      // circles, and the bounding circle of polygons
+	int NumVertices;   // polygons - counter-clockwise about the centre of mass
+	glm::vec2 Vertices[MAX_POLYGON_VERTICES];
+	glm::vec2 Normals[MAX_POLYGON_VERTICES];
+	glm::vec2 WorldVertices[MAX_POLYGON_VERTICES]; // at the current pose
+	glm::vec2 WorldNormals[MAX_POLYGON_VERTICES];
+
+	float InvMass, InvInertia; // 0 for static bodies - motion holds the ones the solver sees
+	float Friction, Restitution;
+
+	bool Enabled; // disabled bodies neither move nor collide
+	bool Awake;   // bodies at rest hold still, as if static, until an awake one touches them
+	bool Bullet;  // fast movers - swept through each step so they cannot pass through thin bodies
+	bool Teleported; // put somewhere this tick instead of moving there - drawn without interpolation
+	float SleepTime; // how long it has been slow enough to rest
+	float Impulse; // largest impact impulse taken in the last step - resting and settling contacts leave it 0
+
+	int Kind;        // what the game makes of the body
+	int EntityId;    // row in the render table, -1 for none
+	glm::vec2 Pivot; // mesh origin in body coordinates
+};
+typedef struct Body Body;
+
+/* Where two bodies touch - one or two points sharing a normal that points from A to B */
+struct Contact {
+	int A, B;
+	glm::vec2 Normal;
+	int NumPoints;
+	glm::vec2 Points[2];
+	float Depth[2]; // overlap, negative while there is still a gap
+	float Friction, Restitution;
+	float Approach; // fastest closing speed at its points when the step started
+
+	// Solver state per point
+	glm::vec2 RA[2], RB[2];
+	float NormalMass[2], TangentMass[2];
+	float Bias[2];
+	float NormalImpulse[2], TangentImpulse[2];
+};
+typedef struct Contact Contact;
+
+vector<Body> bodies;
+vector<Contact> contacts;
+
+/* Where every body is and how it moves, one array per field so the integration runs eight bodies at a time.
+ * Index i belongs to bodies[i]. InvMass and InvInertia are 0 for bodies that are static, resting or
+ * disabled, so the solver and the integration leave those alone without checking */
+struct Motion {
+	vector<float> X, Y;   // centre of mass
+	vector<float> VX, VY;
+	vector<float> Angle;  // radians, counter-clockwise
+	vector<float> Omega;
+	vector<float> InvMass, InvInertia;
+} motion;
+
+glm::vec2 bodyPosition (int id)
+{
+	return glm::vec2(motion.X[id], motion.Y[id]);
+}
+
+glm::vec2 bodyVelocity (int id)
+{
+	return glm::vec2(motion.VX[id], motion.VY[id]);
+}
+
+/* Hand the solver the body's mass once it moves, and take it back while it does not */
+void updateBodyMass (int id)
+{
+	bool moving = bodies[id].Enabled && bodies[id].Awake;
+	motion.InvMass[id] = moving ? bodies[id].InvMass : 0;
+	motion.InvInertia[id] = moving ? bodies[id].InvInertia : 0;
+}
+
+/* A body put to rest holds still, one woken starts its sleep timer over */
+void setBodyAwake (int id, bool awake)
+{
+	bodies[id].Awake = awake;
+	bodies[id].SleepTime = 0;
+	if(!awake)
+	{
+		motion.VX[id] = motion.VY[id] = 0;
+		motion.Omega[id] = 0;
+	}
+	updateBodyMass(id);
+}
+
+float cross2D (glm::vec2 a, glm::vec2 b)
+{
+	return a.x*b.y - a.y*b.x;
+}
+
+/* Velocity of a point at r from the centre of a body spinning at w */
+glm::vec2 spin (float w, glm::vec2 r)
+{
+	return glm::vec2(-w*r.y, w*r.x);
+}
+
+glm::vec2 rotatePoint (glm::vec2 v, float angle)
+{
+	float c = cos(angle), s = sin(angle);
+	return glm::vec2(c*v.x - s*v.y, s*v.x + c*v.y);
+}
+
+/* Move the polygon outline to the body's current pose */
+void updateBodyShape (int id)
+{
+	Body &body = bodies[id];
+	if(body.Shape != SHAPE_POLYGON)
+		return;
+	glm::vec2 position = bodyPosition(id);
+	float c = cos(motion.Angle[id]), s = sin(motion.Angle[id]);
+	for(int i=0;i<body.NumVertices;i++)
+	{
+		glm::vec2 v = body.Vertices[i], n = body.Normals[i];
+		body.WorldVertices[i] = position + glm::vec2(c*v.x - s*v.y, s*v.x + c*v.y);
+		body.WorldNormals[i] = glm::vec2(c*n.x - s*n.y, s*n.x + c*n.y);
+	}
+}
+
+Body newBody (int shape)
+{
+	Body body = Body();
+	body.Shape = shape;
+	body.Friction = 0.5f;
+	body.Restitution = 0.1f;
+	body.Enabled = true;
+	body.EntityId = -1;
+	return body;
+}
+
+/* Append the body at rest at position - returns its id */
+int pushBody (const Body &body, glm::vec2 position)
+{
+	bodies.push_back(body);
+	motion.X.push_back(position.x);
+	motion.Y.push_back(position.y);
+	motion.VX.push_back(0);
+	motion.VY.push_back(0);
+	motion.Angle.push_back(0);
+	motion.Omega.push_back(0);
+	motion.InvMass.push_back(0);
+	motion.InvInertia.push_back(0);
+
+	int id = bodies.size()-1;
+	updateBodyMass(id);
+	updateBodyShape(id);
+	return id;
+}
+
+/* Append a convex polygon given by its world corners - density 0 makes it static. Returns its id */
+int addPolygonBody (const glm::vec2* corners, int count, float density)
+{
+	// Area weighted centroid and second moment, taken about the first corner to keep the numbers small
+	float area = 0, moment = 0;
+	glm::vec2 centroid(0, 0);
+	for(int i=1;i+1<count;i++)
+	{
+		glm::vec2 e1 = corners[i] - corners[0], e2 = corners[i+1] - corners[0];
+		float a = 0.5f*cross2D(e1, e2);
+		area += a;
+		centroid += a*(e1 + e2)/3.0f;
+		moment += a*(glm::dot(e1, e1) + glm::dot(e1, e2) + glm::dot(e2, e2))/6.0f;
+	}
+	centroid = centroid/area;
+
+	Body body = newBody(SHAPE_POLYGON);
+	glm::vec2 position = corners[0] + centroid;
+	body.NumVertices = count;
+	for(int i=0;i<count;i++)
+	{
+		// Clockwise outlines are walked backwards
+		int j = (area > 0) ? i : count-1-i;
+		body.Vertices[i] = corners[j] - position;
+		body.Radius = max(body.Radius, glm::length(body.Vertices[i]));
+	}
+	for(int i=0;i<count;i++)
+	{
+		glm::vec2 edge = body.Vertices[(i+1)%count] - body.Vertices[i];
+		body.Normals[i] = glm::normalize(glm::vec2(edge.y, -edge.x));
+	}
+	if(density > 0)
+	{
+		float mass = density*fabs(area);
+		body.InvMass = 1/mass;
+		body.InvInertia = 1/(density*fabs(moment) - mass*glm::dot(centroid, centroid));
+	}
+	return pushBody(body, position);
+}
+
+int addCircleBody (float radius, glm::vec2 centre, float density)
+{
+	Body body = newBody(SHAPE_CIRCLE);
+	body.Radius = radius;
+	if(density > 0)
+	{
+		float mass = density*M_PI*radius*radius;
+		body.InvMass = 1/mass;
+		body.InvInertia = 2/(mass*radius*radius);
+	}
+	return pushBody(body, centre);
+}
+
+/* Largest separation of b from any face of a - the face a and b overlap least along */
+float maxSeparation (const Body &a, const Body &b, int &face)
+{
+	float best = -FLT_MAX;
+	for(int i=0;i<a.NumVertices;i++)
+	{
+		float deepest = FLT_MAX;
+		for(int j=0;j<b.NumVertices;j++)
+			deepest = min(deepest, glm::dot(a.WorldNormals[i], b.WorldVertices[j] - a.WorldVertices[i]));
+		if(deepest > best)
+		{
+			best = deepest;
+			face = i;
+		}
+	}
+	return best;
+}
+
+/* Keep the part of the segment with dot(normal, p) <= offset - false if none of it is left */
+bool clipSegment (glm::vec2 points[2], glm::vec2 normal, float offset)
+{
+	float d0 = glm::dot(normal, points[0]) - offset;
+	float d1 = glm::dot(normal, points[1]) - offset;
+	if(d0 > 0 && d1 > 0)
+		return false;
+	if(d0 > 0)
+		points[0] = points[0] + (points[1] - points[0])*(d0/(d0 - d1));
+	else if(d1 > 0)
+		points[1] = points[1] + (points[0] - points[1])*(d1/(d1 - d0));
+	return true;
+}
+
+/* Separating axis test, then the incident face of one polygon is clipped against the reference face of the other */
+bool collidePolygons (int a, int b, Contact &contact)
+{
+	int faceA = 0, faceB = 0;
+	float separationA = maxSeparation(bodies[a], bodies[b], faceA);
+	if(separationA > CONTACT_MARGIN)
+		return false;
+	float separationB = maxSeparation(bodies[b], bodies[a], faceB);
+	if(separationB > CONTACT_MARGIN)
+		return false;
+
+	// Prefer A as the reference, so the contact does not flip between steps when both are about as deep
+	bool flip = separationB > separationA + 0.1f*PENETRATION_SLOP;
+	const Body &reference = flip ? bodies[b] : bodies[a];
+	const Body &incident = flip ? bodies[a] : bodies[b];
+	int face = flip ? faceB : faceA;
+	glm::vec2 normal = reference.WorldNormals[face];
+
+	// The incident face is the one most against the reference normal
+	int edge = 0;
+	float lowest = FLT_MAX;
+	for(int i=0;i<incident.NumVertices;i++)
+	{
+		float d = glm::dot(normal, incident.WorldNormals[i]);
+		if(d < lowest)
+		{
+			lowest = d;
+			edge = i;
+		}
+	}
+	glm::vec2 points[2] = { incident.WorldVertices[edge], incident.WorldVertices[(edge+1)%incident.NumVertices] };
+
+	glm::vec2 v1 = reference.WorldVertices[face];
+	glm::vec2 v2 = reference.WorldVertices[(face+1)%reference.NumVertices];
+	glm::vec2 tangent = glm::normalize(v2 - v1);
+	if(!clipSegment(points, -tangent, -glm::dot(tangent, v1)) || !clipSegment(points, tangent, glm::dot(tangent, v2)))
+		return false;
+
+	contact.NumPoints = 0;
+	for(int i=0;i<2;i++)
+	{
+		float separation = glm::dot(normal, points[i] - v1);
+		if(separation <= CONTACT_MARGIN)
+		{
+			contact.Points[contact.NumPoints] = points[i];
+			contact.Depth[contact.NumPoints] = -separation;
+			contact.NumPoints++;
+		}
+	}
+	contact.Normal = flip ? -normal : normal;
+	return contact.NumPoints > 0;
+}
+
+/* Polygon a against circle b - the nearest feature of the polygon is a face or, past its ends, a corner */
+bool collidePolygonCircle (int a, int b, Contact &contact)
+{
+	const Body &polygon = bodies[a];
+	const Body &circle = bodies[b];
+	glm::vec2 centre = bodyPosition(b);
+	int face = 0;
+	float separation = -FLT_MAX;
+	for(int i=0;i<polygon.NumVertices;i++)
+	{
+		float s = glm::dot(polygon.WorldNormals[i], centre - polygon.WorldVertices[i]);
+		if(s > separation)
+		{
+			separation = s;
+			face = i;
+		}
+	}
+	if(separation > circle.Radius + CONTACT_MARGIN)
+		return false;
+
+	glm::vec2 normal = polygon.WorldNormals[face];
+	float distance = separation;
+	if(separation > 0)
+	{
+		glm::vec2 v1 = polygon.WorldVertices[face];
+		glm::vec2 v2 = polygon.WorldVertices[(face+1)%polygon.NumVertices];
+		glm::vec2 corner;
+		bool past = true;
+		if(glm::dot(centre - v1, v2 - v1) < 0)
+			corner = v1;
+		else if(glm::dot(centre - v2, v1 - v2) < 0)
+			corner = v2;
+		else
+			past = false;
+		if(past)
+		{
+			glm::vec2 d = centre - corner;
+			distance = glm::length(d);
+			if(distance > circle.Radius + CONTACT_MARGIN)
+				return false;
+			normal = d/distance;
+		}
+	}
+	contact.Normal = normal;
+	contact.NumPoints = 1;
+	contact.Points[0] = centre - normal*circle.Radius;
+	contact.Depth[0] = circle.Radius - distance;
+	return true;
+}
+
+bool collideCircles (int a, int b, Contact &contact)
+{
+	glm::vec2 d = bodyPosition(b) - bodyPosition(a);
+	float distance = glm::length(d);
+	if(distance > bodies[a].Radius + bodies[b].Radius + CONTACT_MARGIN)
+		return false;
+	contact.Normal = (distance > 0) ? d/distance : glm::vec2(0, 1);
+	contact.NumPoints = 1;
+	contact.Points[0] = bodyPosition(a) + contact.Normal*bodies[a].Radius;
+	contact.Depth[0] = bodies[a].Radius + bodies[b].Radius - distance;
+	return true;
+}
+
+/* Narrow phase for one pair from the broad phase - appends the contact if the two touch */
+void collide (int a, int b)
+{
+	// Polygons go first
+	if(bodies[a].Shape == SHAPE_CIRCLE && bodies[b].Shape == SHAPE_POLYGON)
+		swap(a, b);
+
+	// Bounding circles
+	glm::vec2 d = bodyPosition(b) - bodyPosition(a);
+	float reach = bodies[a].Radius + bodies[b].Radius + CONTACT_MARGIN;
+	if(glm::dot(d, d) > reach*reach)
+		return;
+
+	Contact contact;
+	contact.A = a;
+	contact.B = b;
+	bool touching;
+	if(bodies[a].Shape == SHAPE_POLYGON)
+		touching = (bodies[b].Shape == SHAPE_POLYGON) ? collidePolygons(a, b, contact) : collidePolygonCircle(a, b, contact);
+	else
+		touching = collideCircles(a, b, contact);
+	if(touching)
+		contacts.push_back(contact);
+}
+
+/* Sweep and prune on x - the levels are wide and flat, so few bodies share an x range. The bodies stay
+ * sorted by the left edge of their bounds from one step to the next, so the insertion sort only moves
+ * the few that overtook a neighbour. Pairs that overlap on x are checked on y before the narrow phase */
+struct Bounds {
+	float MinX, MaxX;
+	float MinY, MaxY;
+};
+typedef struct Bounds Bounds;
+
+struct Broadphase {
+	vector<int> Order;     // body ids by MinX, kept between steps
+	vector<Bounds> Boxes;  // per body, grown by CONTACT_MARGIN
+	long Candidates;       // pairs handed to the narrow phase in the last step
+	long Moves;            // places the sort moved bodies by in the last step
+	long TotalCandidates, TotalContacts, TotalMoves, Steps;
+} broadphase;
+
+void updateBodyBounds (int i)
+{
+	const Body &body = bodies[i];
+	Bounds &box = broadphase.Boxes[i];
+	if(body.Shape == SHAPE_CIRCLE)
+	{
+		box.MinX = motion.X[i] - body.Radius;
+		box.MaxX = motion.X[i] + body.Radius;
+		box.MinY = motion.Y[i] - body.Radius;
+		box.MaxY = motion.Y[i] + body.Radius;
+	}
+	else
+	{
+		box.MinX = box.MaxX = body.WorldVertices[0].x;
+		box.MinY = box.MaxY = body.WorldVertices[0].y;
+		for(int j=1;j<body.NumVertices;j++)
+		{
+			box.MinX = min(box.MinX, body.WorldVertices[j].x);
+			box.MaxX = max(box.MaxX, body.WorldVertices[j].x);
+			box.MinY = min(box.MinY, body.WorldVertices[j].y);
+			box.MaxY = max(box.MaxY, body.WorldVertices[j].y);
+		}
+	}
+	// Half the margin each, so bodies that close to each other still pair up
+	box.MinX -= 0.5f*CONTACT_MARGIN;
+	box.MaxX += 0.5f*CONTACT_MARGIN;
+	box.MinY -= 0.5f*CONTACT_MARGIN;
+	box.MaxY += 0.5f*CONTACT_MARGIN;
+}
+
+/* Only moving bodies get new bounds - resting and static ones keep theirs */
+void updateBounds ()
+{
+	int known = broadphase.Boxes.size();
+	broadphase.Boxes.resize(bodies.size());
+	for(int i=0;i<(int)bodies.size();i++)
+		if(i >= known || motion.InvMass[i] > 0)
+			updateBodyBounds(i);
+}
+
+/* Insertion sort from last step's order - new bodies join at the end */
+void sortBounds ()
+{
+	vector<int> &order = broadphase.Order;
+	for(int i=order.size();i<(int)bodies.size();i++)
+		order.push_back(i);
+
+	broadphase.Moves = 0;
+	for(int i=1;i<(int)order.size();i++)
+	{
+		int id = order[i];
+		float left = broadphase.Boxes[id].MinX;
+		int j = i;
+		for(;j>0 && broadphase.Boxes[order[j-1]].MinX > left;j--)
+			order[j] = order[j-1];
+		order[j] = id;
+		broadphase.Moves += i-j;
+	}
+}
+
+/* Sweep the sorted bounds - every pair with something moving in it whose boxes overlap goes to collide() */
+void findPairs ()
+{
+	const vector<int> &order = broadphase.Order;
+	const vector<Bounds> &boxes = broadphase.Boxes;
+	broadphase.Candidates = 0;
+	for(int i=0;i<(int)order.size();i++)
+	{
+		int a = order[i];
+		if(!bodies[a].Enabled)
+			continue;
+		for(int j=i+1;j<(int)order.size() && boxes[order[j]].MinX <= boxes[a].MaxX;j++)
+		{
+			int b = order[j];
+			if(!bodies[b].Enabled || (!bodies[a].Awake && !bodies[b].Awake))
+				continue;
+			if(boxes[a].MinY > boxes[b].MaxY || boxes[b].MinY > boxes[a].MaxY)
+				continue;
+			broadphase.Candidates++;
+			collide(a, b);
+		}
+	}
+	broadphase.TotalCandidates += broadphase.Candidates;
+	broadphase.TotalContacts += contacts.size();
+	broadphase.TotalMoves += broadphase.Moves;
+	broadphase.Steps++;
+}
+
+void printBroadphaseStats ()
+{
+	if(broadphase.Steps == 0)
+		return;
+	cout << "Broadphase per step: candidates=" << (double)broadphase.TotalCandidates/broadphase.Steps;
+	cout << " contacts=" << (double)broadphase.TotalContacts/broadphase.Steps;
+	cout << " sort moves=" << (double)broadphase.TotalMoves/broadphase.Steps;
+	cout << " (" << broadphase.Steps << " steps)" << '\n';
+}
+
+/* Taking a body out wakes the resting ones whose bounds touch it - they may have leant on it */
+void setBodyEnabled (int id, bool enabled)
+{
+	bodies[id].Enabled = enabled;
+	updateBodyMass(id);
+	if(enabled || id >= (int)broadphase.Boxes.size())
+		return;
+	const Bounds &box = broadphase.Boxes[id];
+	for(int i=0;i<(int)broadphase.Boxes.size();i++)
+	{
+		const Bounds &other = broadphase.Boxes[i];
+		if(bodies[i].Enabled && !bodies[i].Awake && bodies[i].InvMass > 0 && other.MinX <= box.MaxX && box.MinX <= other.MaxX && other.MinY <= box.MaxY && box.MinY <= other.MaxY)
+			setBodyAwake(i, true);
+	}
+}
+
+/* One side of a contact while it is solved - gathered from motion once, so the iterations do not walk six arrays per impulse */
+struct SolverBody {
+	glm::vec2 Velocity;
+	float AngularVelocity;
+	float InvMass, InvInertia;
+};
+typedef struct SolverBody SolverBody;
+
+SolverBody loadSolverBody (int id)
+{
+	SolverBody body;
+	body.Velocity = bodyVelocity(id);
+	body.AngularVelocity = motion.Omega[id];
+	body.InvMass = motion.InvMass[id];
+	body.InvInertia = motion.InvInertia[id];
+	return body;
+}
+
+void storeSolverBody (int id, const SolverBody &body)
+{
+	motion.VX[id] = body.Velocity.x;
+	motion.VY[id] = body.Velocity.y;
+	motion.Omega[id] = body.AngularVelocity;
+}
+
+void applyImpulse (SolverBody &a, SolverBody &b, glm::vec2 rA, glm::vec2 rB, glm::vec2 impulse)
+{
+	a.Velocity -= impulse*a.InvMass;
+	a.AngularVelocity -= a.InvInertia*cross2D(rA, impulse);
+	b.Velocity += impulse*b.InvMass;
+	b.AngularVelocity += b.InvInertia*cross2D(rB, impulse);
+}
+
+glm::vec2 relativeVelocity (const SolverBody &a, const SolverBody &b, glm::vec2 rA, glm::vec2 rB)
+{
+	return b.Velocity + spin(b.AngularVelocity, rB) - a.Velocity - spin(a.AngularVelocity, rA);
+}
+
+/* Effective masses and target velocities - overlaps are pushed out over a few steps, and a gap may close this step */
+void prepareContact (Contact &c, float dt)
+{
+	int a = c.A, b = c.B;
+	c.Friction = sqrt(bodies[a].Friction*bodies[b].Friction);
+	c.Restitution = max(bodies[a].Restitution, bodies[b].Restitution);
+	glm::vec2 tangent(c.Normal.y, -c.Normal.x);
+	SolverBody bodyA = loadSolverBody(a), bodyB = loadSolverBody(b);
+	float mass = bodyA.InvMass + bodyB.InvMass;
+	float inertiaA = bodyA.InvInertia, inertiaB = bodyB.InvInertia;
+	c.Approach = 0;
+	for(int j=0;j<c.NumPoints;j++)
+	{
+		c.RA[j] = c.Points[j] - bodyPosition(a);
+		c.RB[j] = c.Points[j] - bodyPosition(b);
+		float rnA = cross2D(c.RA[j], c.Normal), rnB = cross2D(c.RB[j], c.Normal);
+		float rtA = cross2D(c.RA[j], tangent), rtB = cross2D(c.RB[j], tangent);
+		c.NormalMass[j] = 1/(mass + inertiaA*rnA*rnA + inertiaB*rnB*rnB);
+		c.TangentMass[j] = 1/(mass + inertiaA*rtA*rtA + inertiaB*rtB*rtB);
+
+		float depth = c.Depth[j];
+		c.Bias[j] = (depth < 0) ? depth/dt : BAUMGARTE*max(depth - PENETRATION_SLOP, 0.0f)/dt;
+		float approach = glm::dot(relativeVelocity(bodyA, bodyB, c.RA[j], c.RB[j]), c.Normal);
+		c.Approach = max(c.Approach, -approach);
+		if(approach < -RESTITUTION_SPEED)
+			c.Bias[j] = max(c.Bias[j], -c.Restitution*approach);
+		c.NormalImpulse[j] = 0;
+		c.TangentImpulse[j] = 0;
+	}
+}
+
+void prepareContacts (float dt)
+{
+	for(int i=0;i<(int)contacts.size();i++)
+		prepareContact(contacts[i], dt);
+}
+
+/* One pass of sequential impulses - the accumulated impulse never pulls, and friction stays inside its cone */
+void solveContact (Contact &c)
+{
+	SolverBody a = loadSolverBody(c.A), b = loadSolverBody(c.B);
+	glm::vec2 tangent(c.Normal.y, -c.Normal.x);
+	for(int j=0;j<c.NumPoints;j++)
+	{
+		float vn = glm::dot(relativeVelocity(a, b, c.RA[j], c.RB[j]), c.Normal);
+		float impulse = max(c.NormalImpulse[j] + c.NormalMass[j]*(c.Bias[j] - vn), 0.0f);
+		applyImpulse(a, b, c.RA[j], c.RB[j], c.Normal*(impulse - c.NormalImpulse[j]));
+		c.NormalImpulse[j] = impulse;
+
+		float vt = glm::dot(relativeVelocity(a, b, c.RA[j], c.RB[j]), tangent);
+		float limit = c.Friction*c.NormalImpulse[j];
+		float friction = min(max(c.TangentImpulse[j] - c.TangentMass[j]*vt, -limit), limit);
+		applyImpulse(a, b, c.RA[j], c.RB[j], tangent*(friction - c.TangentImpulse[j]));
+		c.TangentImpulse[j] = friction;
+	}
+	storeSolverBody(c.A, a);
+	storeSolverBody(c.B, b);
+}
+
+void solveContacts ()
+{
+	for(int i=0;i<(int)contacts.size();i++)
+		solveContact(contacts[i]);
+}
+
+#ifdef AVX2_KERNELS
+bool cpuHasAVX2 = (__builtin_cpu_init(), __builtin_cpu_supports("avx2"));
+
+/* Eight bodies per iteration, the ones with no mass are blended back unchanged - returns how many it did.
+ * Only separate multiplies and adds, like the scalar loops, so both give the same numbers */
+AVX2_TARGET int integrateVelocitiesAVX2 (float* vx, float* vy, float* omega, const float* invMass, int n, float gravity, float linear, float angular)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 g = _mm256_set1_ps(gravity), l = _mm256_set1_ps(linear), a = _mm256_set1_ps(angular);
+	int i = 0;
+	for (; i+7<n; i+=8) {
+		__m256 moving = _mm256_cmp_ps(_mm256_loadu_ps(invMass + i), zero, _CMP_GT_OQ);
+		if(_mm256_movemask_ps(moving) == 0)
+			continue; // all resting
+		__m256 x = _mm256_loadu_ps(vx + i), y = _mm256_loadu_ps(vy + i), w = _mm256_loadu_ps(omega + i);
+		_mm256_storeu_ps(vx + i, _mm256_blendv_ps(x, _mm256_mul_ps(x, l), moving));
+		_mm256_storeu_ps(vy + i, _mm256_blendv_ps(y, _mm256_mul_ps(_mm256_sub_ps(y, g), l), moving));
+		_mm256_storeu_ps(omega + i, _mm256_blendv_ps(w, _mm256_mul_ps(w, a), moving));
+	}
+	return i;
+}
+
+AVX2_TARGET int integratePositionsAVX2 (float* px, float* py, float* angle, const float* vx, const float* vy, const float* omega, const float* invMass, int n, float dt)
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 step = _mm256_set1_ps(dt);
+	int i = 0;
+	for (; i+7<n; i+=8) {
+		__m256 moving = _mm256_cmp_ps(_mm256_loadu_ps(invMass + i), zero, _CMP_GT_OQ);
+		if(_mm256_movemask_ps(moving) == 0)
+			continue;
+		__m256 x = _mm256_loadu_ps(px + i), y = _mm256_loadu_ps(py + i), a = _mm256_loadu_ps(angle + i);
+		x = _mm256_blendv_ps(x, _mm256_add_ps(x, _mm256_mul_ps(_mm256_loadu_ps(vx + i), step)), moving);
+		y = _mm256_blendv_ps(y, _mm256_add_ps(y, _mm256_mul_ps(_mm256_loadu_ps(vy + i), step)), moving);
+		a = _mm256_blendv_ps(a, _mm256_add_ps(a, _mm256_mul_ps(_mm256_loadu_ps(omega + i), step)), moving);
+		_mm256_storeu_ps(px + i, x);
+		_mm256_storeu_ps(py + i, y);
+		_mm256_storeu_ps(angle + i, a);
+	}
+	return i;
+}
+#endif
+
+/* Gravity and damping for every body the solver moves - the rest keep their velocities */
+void integrateVelocities (float dt)
+{
+	float *vx = &motion.VX[0], *vy = &motion.VY[0], *omega = &motion.Omega[0];
+	const float *invMass = &motion.InvMass[0];
+	const float gravity = GRAVITY*dt, linear = 1/(1 + LINEAR_DAMPING*dt), angular = 1/(1 + ANGULAR_DAMPING*dt);
+	int n = bodies.size(), i = 0;
+#ifdef AVX2_KERNELS
+	if(cpuHasAVX2)
+		i = integrateVelocitiesAVX2(vx, vy, omega, invMass, n, gravity, linear, angular);
+#endif
+	for (; i<n; i++) {
+		if(invMass[i] <= 0)
+			continue;
+		vx[i] = vx[i]*linear;
+		vy[i] = (vy[i] - gravity)*linear;
+		omega[i] = omega[i]*angular;
+	}
+}
+
+/* Semi-implicit Euler - the new velocities carry the bodies to their new poses */
+void integratePositions (float dt)
+{
+	float *px = &motion.X[0], *py = &motion.Y[0], *angle = &motion.Angle[0];
+	const float *vx = &motion.VX[0], *vy = &motion.VY[0], *omega = &motion.Omega[0];
+	const float *invMass = &motion.InvMass[0];
+	int n = bodies.size(), i = 0;
+#ifdef AVX2_KERNELS
+	if(cpuHasAVX2)
+		i = integratePositionsAVX2(px, py, angle, vx, vy, omega, invMass, n, dt);
+#endif
+	for (; i<n; i++) {
+		if(invMass[i] <= 0)
+			continue;
+		px[i] = px[i] + vx[i]*dt;
+		py[i] = py[i] + vy[i]*dt;
+		angle[i] = angle[i] + omega[i]*dt;
+	}
+
+	for(i=0;i<n;i++)
+		if(invMass[i] > 0)
+			updateBodyShape(i);
+}
+
+/* Fraction of the move from..to after which a point comes within radius of centre - 1 if it never does,
+ * or if it already is at the start, as that is a contact the solver has seen */
+float sweepPoint (glm::vec2 from, glm::vec2 to, glm::vec2 centre, float radius)
+{
+	glm::vec2 d = to - from, m = from - centre;
+	float a = glm::dot(d, d), b = glm::dot(m, d), c = glm::dot(m, m) - radius*radius;
+	if(c <= 0 || b >= 0)
+		return 1;
+	float disc = b*b - a*c;
+	if(disc < 0)
+		return 1;
+	return min((-b - sqrt(disc))/a, 1.0f);
+}
+
+/* The same for a polygon grown by radius - the point meets either a face or one of the rounded corners first */
+float sweepPolygon (const Body &polygon, glm::vec2 from, glm::vec2 to, float radius)
+{
+	float first = 1;
+	for(int i=0;i<polygon.NumVertices;i++)
+	{
+		glm::vec2 v1 = polygon.WorldVertices[i], v2 = polygon.WorldVertices[(i+1)%polygon.NumVertices];
+		glm::vec2 normal = polygon.WorldNormals[i];
+		float s0 = glm::dot(normal, from - v1) - radius, s1 = glm::dot(normal, to - v1) - radius;
+		if(s0 >= 0 && s1 < 0)
+		{
+			float t = s0/(s0 - s1);
+			float along = glm::dot(from + (to - from)*t - v1, v2 - v1);
+			if(along >= 0 && along <= glm::dot(v2 - v1, v2 - v1))
+				first = min(first, t);
+		}
+		first = min(first, sweepPoint(from, to, v1, radius));
+	}
+	return first;
+}
+
+bool inContact (int a, int b)
+{
+	for(int i=0;i<(int)contacts.size();i++)
+		if((contacts[i].A == a && contacts[i].B == b) || (contacts[i].A == b && contacts[i].B == a))
+			return true;
+	return false;
+}
+
+/* Time of impact of circle id moving from..to, as a fraction of the move - hit is the body it meets first, -1 for none.
+ * Bodies it is already in contact with are left to the solver */
+float sweepCircle (int id, glm::vec2 from, glm::vec2 to, int &hit)
+{
+	float radius = bodies[id].Radius, first = 1;
+	glm::vec2 d = to - from;
+	float length = glm::length(d);
+	hit = -1;
+	for(int i=0;i<(int)bodies.size();i++)
+	{
+		const Body &body = bodies[i];
+		if(i == id || !body.Enabled)
+			continue;
+		// Bounding circle against the swept segment
+		glm::vec2 m = bodyPosition(i) - from;
+		float along = (length > 0) ? min(max(glm::dot(m, d)/length, 0.0f), length) : 0;
+		glm::vec2 closest = (length > 0) ? m - d*(along/length) : m;
+		float reach = radius + body.Radius;
+		if(glm::dot(closest, closest) > reach*reach || inContact(id, i))
+			continue;
+
+		float t = (body.Shape == SHAPE_CIRCLE) ? sweepPoint(from, to, bodyPosition(i), reach) : sweepPolygon(body, from, to, radius);
+		if(t < first)
+		{
+			first = t;
+			hit = i;
+		}
+	}
+	return first;
+}
+
+/* Fly a bullet through the step from start - each sub-step ends where it first touches something, and that contact
+ * is solved there for the time left, so however far it goes in one step it cannot pass through a thin block or a pig */
+void sweepBullet (int id, glm::vec2 start, float dt)
+{
+	glm::vec2 position = start;
+	float remaining = dt;
+	for(int i=0;i<MAX_SUBSTEPS;i++)
+	{
+		glm::vec2 end = position + bodyVelocity(id)*remaining;
+		int hit;
+		float t = sweepCircle(id, position, end, hit);
+		if(hit < 0)
+		{
+			position = end;
+			break;
+		}
+		position = position + (end - position)*t;
+		remaining = remaining*(1 - t);
+		motion.X[id] = position.x;
+		motion.Y[id] = position.y;
+
+		bool woke = bodies[hit].InvMass > 0 && !bodies[hit].Awake;
+		if(woke)
+			setBodyAwake(hit, true);
+		int first = contacts.size();
+		collide(id, hit);
+		for(int j=first;j<(int)contacts.size();j++)
+		{
+			prepareContact(contacts[j], remaining);
+			for(int k=0;k<SOLVER_ITERATIONS;k++)
+				solveContact(contacts[j]);
+		}
+		// A body woken here missed this step's integration, so it is pushed along for the time left or the bullet
+		// would run into it - an awake one has already moved and only takes the new velocity
+		if(woke)
+		{
+			motion.X[hit] += motion.VX[hit]*remaining;
+			motion.Y[hit] += motion.VY[hit]*remaining;
+			motion.Angle[hit] += motion.Omega[hit]*remaining;
+			updateBodyShape(hit);
+		}
+	}
+	motion.X[id] = position.x;
+	motion.Y[id] = position.y;
+	updateBodyShape(id);
+}
+
+/* Bodies at rest - how many there were in the last step, and in all of them */
+struct SleepStats {
+	int Awake, Sleeping; // moving bodies, enabled only
+	int Islands;         // groups of awake bodies in contact
+	long TotalAwake, TotalSleeping, TotalIslands, Steps;
+} sleepStats;
+
+/* Union-find over the contacts, rebuilt every step */
+vector<int> islandParent;
+vector<float> islandSleepTime;
+
+int findIsland (int i)
+{
+	while(islandParent[i] != i)
+	{
+		islandParent[i] = islandParent[islandParent[i]];
+		i = islandParent[i];
+	}
+	return i;
+}
+
+/* Islands are the awake bodies joined by contacts - static and resting bodies hold them up without joining them,
+ * so a block knocked off the tower does not keep the whole tower awake. An island goes to rest once its most
+ * restless body has been slow for SLEEP_TIME, and then costs nothing until an awake body touches it */
+void updateSleep (float dt)
+{
+	int n = bodies.size();
+	islandParent.resize(n);
+	islandSleepTime.assign(n, FLT_MAX);
+	for(int i=0;i<n;i++)
+	{
+		islandParent[i] = i;
+		if(motion.InvMass[i] <= 0)
+			continue;
+		Body &body = bodies[i];
+		float speed = glm::length(bodyVelocity(i)) + fabs(motion.Omega[i])*body.Radius;
+		body.SleepTime = (speed < SLEEP_SPEED) ? body.SleepTime + dt : 0;
+	}
+	for(int i=0;i<(int)contacts.size();i++)
+	{
+		int a = contacts[i].A, b = contacts[i].B;
+		if(motion.InvMass[a] > 0 && motion.InvMass[b] > 0)
+			islandParent[findIsland(a)] = findIsland(b);
+	}
+
+	sleepStats.Islands = 0;
+	for(int i=0;i<n;i++)
+	{
+		if(motion.InvMass[i] <= 0)
+			continue;
+		int island = findIsland(i);
+		islandSleepTime[island] = min(islandSleepTime[island], bodies[i].SleepTime);
+		if(island == i)
+			sleepStats.Islands++;
+	}
+	for(int i=0;i<n;i++)
+	{
+		if(motion.InvMass[i] > 0 && islandSleepTime[findIsland(i)] >= SLEEP_TIME)
+		{
+			setBodyAwake(i, false);
+			updateBodyBounds(i); // the bounds are from before this step's move
+		}
+	}
+
+	sleepStats.Awake = sleepStats.Sleeping = 0;
+	for(int i=0;i<n;i++)
+	{
+		if(!bodies[i].Enabled || bodies[i].InvMass <= 0)
+			continue;
+		if(bodies[i].Awake)
+			sleepStats.Awake++;
+		else
+			sleepStats.Sleeping++;
+	}
+	sleepStats.TotalAwake += sleepStats.Awake;
+	sleepStats.TotalSleeping += sleepStats.Sleeping;
+	sleepStats.TotalIslands += sleepStats.Islands;
+	sleepStats.Steps++;
+}
+
+void printSleepStats ()
+{
+	if(sleepStats.Steps == 0)
+		return;
+	cout << "Bodies per step: awake=" << (double)sleepStats.TotalAwake/sleepStats.Steps;
+	cout << " sleeping=" << (double)sleepStats.TotalSleeping/sleepStats.Steps;
+	cout << " islands=" << (double)sleepStats.TotalIslands/sleepStats.Steps;
+	cout << " (" << sleepStats.Steps << " steps)" << '\n';
+}
+
+/* Advance every awake body by dt - gravity, contacts, then the new positions */
+void stepWorld (float dt)
+{
+	TRACE_SCOPE("stepWorld");
+	for(int i=0;i<(int)bodies.size();i++)
+		bodies[i].Impulse = 0;
+	integrateVelocities(dt);
+
+	contacts.clear();
+	updateBounds();
+	sortBounds();
+	findPairs();
+
+	// Resting bodies touched by a moving one join in - whatever rests on them follows a step later
+	for(int i=0;i<(int)contacts.size();i++)
+	{
+		int a = contacts[i].A, b = contacts[i].B;
+		if(bodies[a].InvMass > 0 && !bodies[a].Awake && bodies[b].Awake)
+			setBodyAwake(a, true);
+		else if(bodies[b].InvMass > 0 && !bodies[b].Awake && bodies[a].Awake)
+			setBodyAwake(b, true);
+	}
+
+	prepareContacts(dt);
+	for(int i=0;i<SOLVER_ITERATIONS;i++)
+		solveContacts();
+
+	// Bullets are moved again, swept from where they started
+	vector< pair<int, glm::vec2> > bullets;
+	for(int i=0;i<(int)bodies.size();i++)
+		if(bodies[i].Bullet && motion.InvMass[i] > 0)
+			bullets.push_back(make_pair(i, bodyPosition(i)));
+	integratePositions(dt);
+	for(int i=0;i<(int)bullets.size();i++)
+		sweepBullet(bullets[i].first, bullets[i].second, dt);
+
+	for(int i=0;i<(int)contacts.size();i++)
+	{
+		Contact &c = contacts[i];
+		if(c.Approach < RESTITUTION_SPEED)
+			continue;
+		float impulse = 0;
+		for(int j=0;j<c.NumPoints;j++)
+			impulse += c.NormalImpulse[j];
+		bodies[c.A].Impulse = max(bodies[c.A].Impulse, impulse);
+		bodies[c.B].Impulse = max(bodies[c.B].Impulse, impulse);
+	}
+
+	updateSleep(dt);
+}
+
+/* No point of an awake body moves faster than speed - spinning counts too, so a block slowly tipping over is not at rest */
+bool worldAtRest (float speed)
+{
+	for(int i=0;i<(int)bodies.size();i++)
+	{
+		const Body &body = bodies[i];
+		if(body.Enabled && body.Awake && glm::length(bodyVelocity(i)) + fabs(motion.Omega[i])*body.Radius >= speed)
+			return false;
+	}
+	return true;
+}
+
+/* Copy a body's pose into its render table row */
+void syncBodyEntity (int id)
+{
+	const Body &body = bodies[id];
+	if(body.EntityId < 0)
+		return;
+	float angle = motion.Angle[id];
+	glm::vec2 origin = bodyPosition(id) + rotatePoint(body.Pivot, angle);
+	setEntityTransform(body.EntityId, origin.x, origin.y, angle*180/M_PI);
+	setEntityVisible(body.EntityId, body.Enabled);
+	if(body.Teleported)
+	{
+		snapEntity(body.EntityId);
+		bodies[id].Teleported = false;
+	}
+}
+
+/**************************
+ * Customizable functions *
+ **************************/
+float triangle_rot_dir = 1;
+float rectangle_rot_dir = 1;
+bool triangle_rot_status = true;
+bool rectangle_rot_status = true;
+float teta = 30;
+float triangle_rotation = 0;
+float rectangle_rotation = 30;
+float x = -840.0f + 200 * cos(DEG2RAD(teta));//*(0.5) + (250 * cos(DEG2RAD(teta)) * (0.5));
+float y = -140.f + 220 * sin(DEG2RAD(teta));// * (0.8) + (220 * sin(DEG2RAD(teta)) * (0.4));
+float u = 100;
+int flag =0;
+int sparkslit = 0;
+int shotover = 0; // shot missed, waiting to put the bird back on the cannon
+int puffing = 0; // smoke puffs still growing
+int birdBody;
+float flightTime = 0; // of the current shot
+float restTime = 0;   // how long everything has been still
+int lifes = 0;
+float tetacannon = 30;
+int reboundfromright = 0;
+float camera_rotation_angle = 90;
+float circle_rotation = 0;
+int width = 1600;
+int height = 800;
+float smokex = -670,smokey = 275;
+int basegone = 0;
+int lifeflag = 0;
+VAO *lifecircle;
+float firsttimez = 0;
+float lefthor = -1000.0f;
+float righthor = 1000.0f;
+float zoomie = 1;
+float vertup = 500.0f;
+float vertdown = -500.f;
+
+float zoo = 0;
+float smokehor = 0.5,smokever = 0.5;
+int score = 0;
+VAO *speedrect;
+float circle_rot_dir = 1;
+bool circle_rot_status =true;
+
+/* Game side of the controls - applied by the simulation at the start of a tick */
+
+/* Turn the cannon by one 2 degree step, up for direction > 0 */
+void aimCannon (int direction)
+{
+	if(direction > 0)
+	{
+		if(flag == 0 && teta < 80)
+		{
+			rectangle_rotation = rectangle_rotation + 2;
+			tetacannon = tetacannon + 2;
+			teta = tetacannon;
+			x = -840.0f + 200 * cos(DEG2RAD(teta));//*(0.5) + (250 * cos(DEG2RAD(teta)) * (0.5)); 
+			y = -140.f + 220 * sin(DEG2RAD(teta));
+			if(tetacannon < 0)
+				y = -140.f + 180 * sin(DEG2RAD(teta));//* (0.8) + (220 * sin(DEG2RAD(teta)) * (0.4));
+			else if(tetacannon > 0 && tetacannon <= 10)
+				y = -140.f + 280 * sin(DEG2RAD(tetacannon));
+		}
+	}
+	else
+	{
+		if(flag == 0 && teta > -10)
+		{
+			rectangle_rotation = rectangle_rotation - 2;
+			tetacannon = tetacannon - 2;
+			teta = tetacannon;
+			x = -840.0f + 200 * cos(DEG2RAD(tetacannon));//*(0.5) + (250 * cos(DEG2RAD(teta)) * (0.5)); 
+			y = -140.f + 220 * sin(DEG2RAD(tetacannon));
+			if(tetacannon < 0)
+				y = -140.f + 180 * sin(DEG2RAD(tetacannon));//* (0.8) + (220 * sin(DEG2RAD(teta)) * (0.4));
+			else if(tetacannon > 0 && tetacannon <= 10)
+				y = -140.f + 280 * sin(DEG2RAD(tetacannon));
+		}
+	}
+}
+
+/* Power up or down by 5 */
+void changePower (int direction)
+{
+	if(flag == 0)
+	{
+		if(direction > 0 && u < 200)
+			u = u+5;
+		else if(direction < 0 && u >= 5)
+			u = u-5;
+	}
+}
+
+long shotsFired = 0;
+
+void launchBird ()
+{
+	if(flag == 0)
+	{
+		flag = 1;
+		shotsFired++;
+		teta = tetacannon;
+		flightTime = 0;
+
+		motion.X[birdBody] = x;
+		motion.Y[birdBody] = y;
+		motion.VX[birdBody] = u*cos(DEG2RAD(teta));
+		motion.VY[birdBody] = u*sin(DEG2RAD(teta));
+		motion.Angle[birdBody] = 0;
+		motion.Omega[birdBody] = 0;
+		bodies[birdBody].Enabled = true;
+		bodies[birdBody].Teleported = true;
+		setBodyAwake(birdBody, true);
+	}
+}
+
+/* Every key, button and scroll step the game listens to - the camera ones never reach the simulation */
+enum { KEY_A, KEY_B, KEY_F, KEY_S, KEY_SPACE, KEY_ML, KEY_MR, KEY_LEFT, KEY_RIGHT, KEY_UP, KEY_DOWN, KEY_WU, KEY_WD, KEY_COUNT };
+const char* keyNames [KEY_COUNT] = { "A", "B", "F", "S", "SPACE", "ML", "MR", "LEFT", "RIGHT", "UP", "DOWN", "WU", "WD" };
+
+enum { INPUT_AIM, INPUT_POWER, INPUT_LAUNCH };
+
+/* What a key does to the game, false for keys that only move the camera */
+bool keyInput (int key, int &type, int &steps)
+{
+	type = INPUT_AIM;
+	steps = 0;
+	if(key == KEY_A)
+		steps = 1;
+	else if(key == KEY_B)
+		steps = -1;
+	else if(key == KEY_F || key == KEY_ML)
+		type = INPUT_POWER, steps = 1;
+	else if(key == KEY_S || key == KEY_MR)
+		type = INPUT_POWER, steps = -1;
+	else if(key == KEY_SPACE)
+		type = INPUT_LAUNCH;
+	else
+		return false;
+	return true;
+}
+
+/* Recording and replay - inputs keyed by the simulation tick they took effect in. Game keys are
+ * recorded and fed back by the simulation thread, camera keys by the render thread */
+struct RecordedInput {
+	long Tick;
+	int Key;
+};
+typedef struct RecordedInput RecordedInput;
+
+bool recording = false;
+vector<RecordedInput> recordedInputs; // simulation thread
+vector<RecordedInput> recordedCamera; // render thread
+
+bool replaying = false;
+vector<RecordedInput> replayInputs;
+size_t replayNext = 0;       // next game key, simulation thread
+size_t replayCameraNext = 0; // next camera key, render thread
+
+long drawnTick = 0; // tick of the snapshot on screen, render thread
+
+/* Input queue - the GLFW callbacks (main thread) push compact timestamped events, the simulation
+ * drains them at tick boundaries. Single producer, single consumer, so two atomic counters do */
+struct InputEvent {
+	double Time;   // clockTime() when the callback fired, the time of the tick they are due on for replayed keys
+	short Type;    // INPUT_*
+	short Steps;   // signed number of aim or power steps
+	short Key;     // KEY_* that caused it
+};
+typedef struct InputEvent InputEvent;
+
+#define INPUT_QUEUE_SIZE 256
+
+struct InputQueue {
+	InputEvent Events[INPUT_QUEUE_SIZE];
+	atomic<unsigned> Head; // next event to drain, written by the simulation
+	atomic<unsigned> Tail; // next free slot, written by the callbacks
+
+	long Applied, Coalesced, Dropped;
+} inputQueue;
+
+void pushInput (int key, double time)
+{
+	int type, steps;
+	if(!keyInput(key, type, steps))
+		return;
+
+	unsigned tail = inputQueue.Tail.load(memory_order_relaxed);
+	if(tail - inputQueue.Head.load(memory_order_acquire) == INPUT_QUEUE_SIZE) {
+		inputQueue.Dropped++;
+		return;
+	}
+	InputEvent event = { time, (short)type, (short)steps, (short)key };
+	inputQueue.Events[tail % INPUT_QUEUE_SIZE] = event;
+	inputQueue.Tail.store(tail + 1, memory_order_release);
+}
+
+void applyInput (const InputEvent &event)
+{
+	int direction = (event.Steps > 0) ? 1 : -1;
+	for(int i=0;i<abs(event.Steps);i++)
+	{
+		if(event.Type == INPUT_AIM)
+			aimCannon(direction);
+		else if(event.Type == INPUT_POWER)
+			changePower(direction);
+	}
+	if(event.Type == INPUT_LAUNCH)
+		launchBird();
+	inputQueue.Applied++;
+}
+
+/* Apply everything that came in up to time, when this tick was due - a tick run late while the simulation
+ * catches up leaves newer events to the tick they fall in. Runs of aim or power steps in the same
+ * direction are merged into one event, so key repeat costs one apply per tick */
+void drainInput (long tick, double time)
+{
+	unsigned head = inputQueue.Head.load(memory_order_relaxed);
+	unsigned tail = inputQueue.Tail.load(memory_order_acquire);
+	InputEvent pending;
+	bool have_pending = false;
+
+	for(; head != tail; head++)
+	{
+		const InputEvent &event = inputQueue.Events[head % INPUT_QUEUE_SIZE];
+		if(event.Time > time)
+			break;
+		if(recording) {
+			RecordedInput input = { tick, event.Key };
+			recordedInputs.push_back(input);
+		}
+		if(have_pending && event.Type == pending.Type && event.Type != INPUT_LAUNCH && (event.Steps > 0) == (pending.Steps > 0))
+		{
+			pending.Steps += event.Steps;
+			inputQueue.Coalesced++;
+			continue;
+		}
+		if(have_pending)
+			applyInput(pending);
+		pending = event;
+		have_pending = true;
+	}
+	if(have_pending)
+		applyInput(pending);
+
+	inputQueue.Head.store(head, memory_order_release);
+}
+
+/* Queue the replayed game keys that are due by this tick */
+void feedReplay (long tick, double time)
+{
+	for(; replayNext < replayInputs.size() && replayInputs[replayNext].Tick <= tick; replayNext++)
+		pushInput(replayInputs[replayNext].Key, time);
+}
+
+void printInputStats ()
+{
+	cout << "Input events: applied=" << inputQueue.Applied << " coalesced=" << inputQueue.Coalesced << " dropped=" << inputQueue.Dropped << '\n';
+}
+
+/* Pan and zoom - view state, only ever touched by the render thread */
+void moveCamera (int key)
+{
+	switch (key) {
+		case KEY_LEFT:
+			if(lefthor > -2000)
+			{	
+				lefthor = lefthor-50;
+				righthor = righthor - 50;
+			}
+			break;
+		case KEY_RIGHT:
+			if(righthor < 2000){
+				lefthor = lefthor + 50;
+				righthor = righthor + 50;
+			}
+			break;
+		case KEY_UP:
+		case KEY_WU:
+			if( zoomie > 0.5){
+				zoomie = zoomie - 0.1;
+				vertup = vertup + 30;
+				vertdown = vertdown - 30;
+				lefthor = lefthor - 60;
+				righthor = righthor + 60;
+			}	
+			break;
+		case KEY_DOWN:
+		case KEY_WD:
+			if(zoomie < 1.5)
+			{	
+				zoomie = zoomie + 0.1;
+				vertup = vertup - 30;
+				vertdown = vertdown + 30;
+				lefthor = lefthor + 60;
+				righthor = righthor - 60 ;
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+/* Route one key, button or scroll step - game keys go to the simulation, the rest move the camera.
+ * A replay owns all of them, so live input is ignored while one runs */
+void pressKey (int key)
+{
+	int type, steps;
+	if(replaying)
+		return;
+	if(keyInput(key, type, steps)) {
+		pushInput(key, clockTime());
+		return;
+	}
+	moveCamera(key);
+	if(recording) {
+		RecordedInput input = { drawnTick, key };
+		recordedCamera.push_back(input);
+	}
+}
+
+/* Camera keys of the replay that are due by the tick on screen */
+void replayCamera (long tick)
+{
+	for(; replayCameraNext < replayInputs.size() && replayInputs[replayCameraNext].Tick <= tick; replayCameraNext++)
+	{
+		int type, steps;
+		if(!keyInput(replayInputs[replayCameraNext].Key, type, steps))
+			moveCamera(replayInputs[replayCameraNext].Key);
+	}
+}
+
+bool profilerVisible = false; // on-screen frame profiler, toggled with P
+
+/* Executed when a regular key is pressed/released/held-down */
+/* Prefered for Keyboard events */
+void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+	// Function is called first on GLFW_PRESS.
+
+	if (action == GLFW_REPEAT || action == GLFW_PRESS) {
+		switch (key) {
+			case GLFW_KEY_A:
+				pressKey(KEY_A);
+				break;
+			case GLFW_KEY_B:
+				pressKey(KEY_B);
+				break;
+			case GLFW_KEY_SPACE:
+				pressKey(KEY_SPACE);
+				break;
+			case GLFW_KEY_F:
+				pressKey(KEY_F);
+				break;
+			case GLFW_KEY_S:
+				pressKey(KEY_S);
+				break;
+			case GLFW_KEY_LEFT:
+				pressKey(KEY_LEFT);
+				break;
+			case GLFW_KEY_RIGHT:
+				pressKey(KEY_RIGHT);
+				break;
+			case GLFW_KEY_UP:
+				pressKey(KEY_UP);
+				break;
+			case GLFW_KEY_DOWN:
+				pressKey(KEY_DOWN);
+				break;
+			case GLFW_KEY_P:
+				profilerVisible = !profilerVisible;
+				break;
+			default:
+				break;
+		}
+	}
+	else if (action == GLFW_RELEASE) {
+		switch (key) {
+
+			break;
+			case GLFW_KEY_ESCAPE:
+			quit(window);
+			break;
+			default:
+			break;
+		}
+	}
+}
+
+/* Executed for character input (like in text boxes) */
+void keyboardChar (GLFWwindow* window, unsigned int key)
+{
+	switch (key) {
+		case 'Q':
+		case 'q':
+			quit(window);
+			break;
+		default:
+			break;
+	}
+}
+
+float mousex,mousey,radi;
+/* Executed when a mouse button is pressed/released */
+void mouseButton (GLFWwindow* window, int button, int action, int mods)
+{
+	switch (button) {
+		case GLFW_MOUSE_BUTTON_LEFT:
+
+			if (action == GLFW_RELEASE)
+				pressKey(KEY_ML);
+
+
+
+
+			// triangle
+			break;
+		case GLFW_MOUSE_BUTTON_RIGHT:
+			if (action == GLFW_RELEASE)
+				pressKey(KEY_MR);
+			break;
+
+		default:
+			break;
+	}
+}
+/*void mouse(GLFWwindow* window,double x,double y)
+  {
+  mousex = float(x / zoomie);
+  mousey = float(y / zoomie);//(-1) * (float(y)-500);
+  cout << "mousex " << mousex << '\n';
+  cout << mousey << '\n';
+  radi = atan((mousey + 140)/(mousex + 840));
+  if(RAD2DEG(radi) < 80 && RAD2DEG(radi) > -10){
+  tetacannon = tetacannon + RAD2DEG(radi);
+  rectangle_rotation = tetacannon;
+  teta = tetacannon;
+
+  x = -840.0f + 200 * cos(DEG2RAD(tetacannon));//*(0.5) + (250 * cos(DEG2RAD(teta)) * (0.5)); 
+  y = -140.f + 220 * sin(DEG2RAD(tetacannon));
+  if(tetacannon < 0)
+  y = -140.f + 180 * sin(DEG2RAD(tetacannon));//* (0.8) + (220 * sin(DEG2RAD(teta)) * (0.4));
+  else if(tetacannon > 0 && tetacannon <= 10)
+  y = -140.f + 280 * sin(DEG2RAD(tetacannon));
+  }
+  }*/		
+
+
+void scrollback(GLFWwindow* window,double x,double y)
+{
+	zoo = float(y)/10;
+	pressKey((zoo >= 0) ? KEY_WU : KEY_WD);
+}
+
+/* Executed when window is resized to 'width' and 'height' */
+/* Modify the bounds of the screen here in glm::ortho or Field of View in glm::Perspective */
+void reshapeWindow (GLFWwindow* window, int width, int height)
+{
+	int fbwidth=width, fbheight=height;
 	/* With Retina display on Mac OS X, GLFW's FramebufferSize
 	   is different from WindowSize */
-	glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+	if(window != NULL)
+		glfwGetFramebufferSize(window, &fbwidth, &fbheight);
 
 	GLfloat fov = 90.0f;
 
@@ -607,28 +2453,69 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 	Matrices.projection = glm::ortho(-1000.0f, 1000.0f, -500.0f, 500.0f, 0.1f, 500.0f);
 }
 
-/* Generate VAO, VBOs and return VAO handle - Common Color for all vertices */
+/* Generate VAO, VBO and return VAO handle - Common Color for all vertices */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat red, const GLfloat green, const GLfloat blue, GLenum fill_mode=GL_FILL)
 {
-	GLfloat* color_buffer_data = new GLfloat [3*numVertices];
-	for (int i=0; i<numVertices; i++) {
-		color_buffer_data [3*i] = red;
-		color_buffer_data [3*i + 1] = green;
-		color_buffer_data [3*i + 2] = blue;
-	}
+	TRACE_SCOPE("create3DObject");
+	vector<Vertex> vertices(numVertices);
+	for (int i=0; i<numVertices; i++)
+		setVertex(vertices[i], vertex_buffer_data[3*i], vertex_buffer_data[3*i + 1], red, green, blue);
 
-	return create3DObject(primitive_mode, numVertices, vertex_buffer_data, color_buffer_data, fill_mode);
+	return create3DObject(primitive_mode, numVertices, &vertices[0], fill_mode);
 }
 
 VAO *triangle, *rectangle,*tree5,*tree6;
-VAO *circle,*hill,*upback,*block2;
-VAO *tree1,*trunk1,*downback,*downfull,*pig2,*pig3,*pig4,*pig5,*pig6,*pig7;
-VAO *block1,*block4,*block5,*block6,*block7,*block8,*block9,*block10,*block11;
+VAO *circle,*hill,*upback;
+VAO *tree1,*trunk1,*downback,*downfull;
 VAO *tree2,*tree3,*tree4,*pig1,*basecannon;
 VAO *sparks;
 
+/* Tower blocks - outline in mesh coordinates, counter-clockwise, and where the mesh origin goes.
+ * The posts end under the big horizontal and the short verticals under the highest one, so no two bodies start out overlapping */
+struct BlockDef {
+	GLfloat Outline[8];
+	float X, Y;
+};
+typedef struct BlockDef BlockDef;
+
+#define TOWER_BLOCKS 12
+const BlockDef towerBlocks [TOWER_BLOCKS] = {
+	{ { 0,0, 40,0, 40,70, 0,70 }, 870, -300 },        // small block right of the hill
+	{ { 0,0, 0,280, -40,280, -40,40 }, 830, -280 },   // right trapezium 1
+	{ { 0,0, 0,200, -40,200, -40,40 }, 750, -200 },   // right trapezium 2
+	{ { 0,0, 600,0, 600,40, 0,40 }, 300, 0 },         // bigger horizontal
+	{ { 0,0, 0,200, -40,200, -40,-40 }, 550, -200 },  // left trapezium
+	{ { 0,0, 40,0, 40,300, 0,300 }, 400, -300 },      // left big bar
+	{ { 0,0, 250,0, 250,30, 0,30 }, 150, -200 },      // below horizontal
+	{ { 0,0, 40,0, 40,100, 0,100 }, 190, -300 },      // left most vertical
+	{ { 0,0, 40,0, 40,110, 0,110 }, 450, 40 },        // upward left vertical
+	{ { 0,0, 40,0, 40,110, 0,110 }, 650, 40 },        // upward right vertical
+	{ { 0,0, 350,0, 350,30, 0,30 }, 400, 150 },       // highest horizontal
+	{ { 0,0, 40,0, 40,100, 0,100 }, 340, -300 },      // right post under the below horizontal
+};
+VAO* blocks [TOWER_BLOCKS];
+
+/* Pigs - ellipse radii and centre */
+struct PigDef {
+	float RadiusX, RadiusY;
+	float X, Y;
+};
+typedef struct PigDef PigDef;
+
+#define TOWER_PIGS 6
+const PigDef towerPigs [TOWER_PIGS] = {
+	{ 50, 40, 650, 220 },  // highest
+	{ 60, 40, 570, 80 },   // central one above fattest hor bar
+	{ 40, 30, 370, 70 },   // left fat bar
+	{ 50, 35, 820, 75 },   // right and fat bar
+	{ 70, 50, 300, -120 }, // biggest left
+	{ 50, 40, 285, -260 }, // pig on the ground, between the posts
+};
+VAO* pigs [TOWER_PIGS];
+
 void createbase()
 {
+	TRACE_SCOPE("createbase");
 	const GLfloat vertex_buffer_data [] = {
 		0, 0,0, // vertex 0
 		400,0,0, // vertex 1
@@ -648,94 +2535,15 @@ void createbase()
 // Creates the triangle object used in this sample code
 void createTriangle ()
 {
-	// ONLY vertices between the bounds specified in glm::ortho will be visible on screen 
-
-	// Define vertex array as used in glBegin (GL_TRIANGLES) 
-
-	GLfloat* vertex_buffer_data = new GLfloat [3*360];
-	GLfloat* color_buffer_data = new GLfloat [3*360];
-	float rad = 60;
-
-	for(int i=0;i<360;i++)
-	{
-		vertex_buffer_data [3*i] = (rad * cos(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 1] = (rad * sin(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 2] = 0;
-		if(i%2 == 0)
-		{
-			color_buffer_data [3*i] = 0.8;
-			color_buffer_data [3*i + 1] = 0.58;
-			color_buffer_data [3*i + 2] = 0.047;
-		}
-		else
-		{
-			color_buffer_data [3*i] = 1.0;
-			color_buffer_data [3*i + 1] = 1.0;
-			color_buffer_data [3*i + 2] = 1.0;
-		}
-	}
-	//205 149 12
-	//61 61 61
-	/*	 vertex_buffer_data [3*360 + 1] = 12;
-	// vertex 1
-	vertex_buffer_data [360 * 3 + 2] = 12;
-	vertex_buffer_data [360 * 3 + 3] = 0;*/
-	/*1.2,-1,0, // vertex 2
-	  1.2, 1,0, // vertex 3
-
-	  1.2, 1,0, // vertex 3
-	  -1.2, 1,0, // vertex 4
-	  -1.2,-1,0  // vertex 1
-	  };*/
-
-/*		vertex_buffer_data [360 * 3 + 4] = 15;
-		vertex_buffer_data [360 * 3 + 5] = 12;
-		vertex_buffer_data [360 * 3 + 6] = 0;
-
-		vertex_buffer_data [360 * 3 + 7] = 12;
-		vertex_buffer_data [360 * 3 + 8] = 15;
-		vertex_buffer_data [360 * 3 + 9] = 0;
-
-		color_buffer_data[3*360 + 1] = 1;
-		color_buffer_data[3*360 + 2] = 0;
-		color_buffer_data[3*360 + 3] = 0;
-		color_buffer_data[3*360 + 4] = 1;
-		color_buffer_data[3*360 + 5] = 0;
-		color_buffer_data[3*360 + 6] = 0;
-		color_buffer_data[3*360 + 7] = 1;
-		color_buffer_data[3*360 + 8] = 0;
-		color_buffer_data[3*360 + 9] = 0;
-
-/* color_buffer_data [] = {
-1,0,0, // color 1
-0,0,1, // color 2
-0,1,0, // color 3
-
-0,1,0, // color 3
-0.3,0.3,0.3, // color 4
-1,0,0  // color 1
-};*/
-triangle = create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
-
-/*static const GLfloat vertex_buffer_data [] = {
-  0, 50,0, // vertex 0
-  -50,-50,0, // vertex 1
-  50,-50,0, // vertex 2
-  };
-
-  static const GLfloat color_buffer_data [] = {
-  1,0,0, // color 0
-  1,0,0, // color 1
-  1,0,0 // color 2
-  };
-
-// create3DObject creates and returns a handle to a VAO that can be used later
-triangle = create3DObject(GL_TRIANGLES, 3, vertex_buffer_data, color_buffer_data, GL_FILL);*/
+	TRACE_SCOPE("createTriangle");
+	// Cannon wheel - gold spokes on white
+	triangle = createEllipseObject(60, 60, 0.8, 0.58, 0.047, 1.0, 1.0, 1.0);
 }
 
 // Creates the rectangle object used in this sample code
 VAO* createRectangle (float x1,float y1,float x2,float y2,float x3,float y3,float x4,float y4,float color1,float color2,float color3)
 {
+	TRACE_SCOPE("createRectangle");
 	// GL3 accepts only Triangles. Quads are not supported
 	const GLfloat vertex_buffer_data [] = {
 		x1,y1,0,
@@ -771,6 +2579,7 @@ VAO* createRectangle (float x1,float y1,float x2,float y2,float x3,float y3,floa
 
 VAO* createblocks (float x1,float y1,float x2,float y2,float x3,float y3,float x4,float y4,float color1,float color2,float color3)
 {
+	TRACE_SCOPE("createblocks");
 	// GL3 accepts only Triangles. Quads are not supported
 	const GLfloat vertex_buffer_data [] = {
 		x1,y1,0, // vertex 1
@@ -828,52 +2637,21 @@ circle = create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_d
 
 VAO* createTrees (float rad1,float rad2,float color1,float color2,float color3)
 {
-	// GL3 accepts only Triangles. Quads are not supported
-
-	GLfloat* vertex_buffer_data = new GLfloat [3*360];
-	GLfloat* color_buffer_data = new GLfloat [3*360];
-	for(int i=0;i<360;i++)
-	{
-		vertex_buffer_data [3*i] = (rad1 * cos(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 1] = (rad2 * sin(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 2] = 0;
-
-		color_buffer_data [3*i] = color1;
-		color_buffer_data [3*i + 1] = color2;
-		color_buffer_data [3*i + 2] = color3;
-	}
-	create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
+	TRACE_SCOPE("createTrees");
+	// One quad, the ellipse edge is evaluated in the fragment shader
+	return createEllipseObject(rad1, rad2, color1, color2, color3, color1, color2, color3);
 }
 VAO* createSparks (float rad1,float rad2)
 {
-	// GL3 accepts only Triangles. Quads are not supported
-
-	GLfloat* vertex_buffer_data = new GLfloat [3*360];
-	GLfloat* color_buffer_data = new GLfloat [3*360];
-	for(int i=0;i<360;i++)
-	{
-		vertex_buffer_data [3*i] = (rad1 * cos(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 1] = (rad2 * sin(DEG2RAD(i)));
-		vertex_buffer_data [3*i + 2] = 0;
-		if(i%2==0)
-		{
-		color_buffer_data [3*i] = 0.8;
-		color_buffer_data [3*i + 1] = 0.58;
-		color_buffer_data [3*i + 2] = 0.047;
-		}
-		else
-		{
-		color_buffer_data [3*i] = 0.239;
-		color_buffer_data [3*i + 1] = 0.239;
-		color_buffer_data [3*i + 2] = 0.239;
-		}
-	}
-	create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
+	TRACE_SCOPE("createSparks");
+	// Gold spokes on grey
+	return createEllipseObject(rad1, rad2, 0.8, 0.58, 0.047, 0.239, 0.239, 0.239);
 }
 
 
 void createbackground ()
 {
+	TRACE_SCOPE("createbackground");
 	// GL3 accepts only Triangles. Quads are not supported
 	const GLfloat vertex_buffer_data [] = {
 		-5000,-300,0, // vertex 1
@@ -901,6 +2679,7 @@ void createbackground ()
 
 void createbackground2 ()
 {
+	TRACE_SCOPE("createbackground2");
 	// GL3 accepts only Triangles. Quads are not supported
 	const GLfloat vertex_buffer_data [] = {
 		-5000,-315,0, // vertex 1
@@ -928,6 +2707,7 @@ void createbackground2 ()
 
 void createbackground3 ()
 {
+	TRACE_SCOPE("createbackground3");
 	// GL3 accepts only Triangles. Quads are not supported
 	const GLfloat vertex_buffer_data [] = {
 		-5000,-2500,0, // vertex 1
@@ -961,6 +2741,7 @@ void createbackground3 ()
 
 void createbaseofcannon ()
 {
+	TRACE_SCOPE("createbaseofcannon");
 	// GL3 accepts only Triangles. Quads are not supported
 	const GLfloat vertex_buffer_data [] = {
 		0,0,0, // vertex 1
@@ -982,1445 +2763,1239 @@ void createbaseofcannon ()
 
 	};
 
-	const GLfloat color_buffer_data [] = {
-
-		0.54,0.137,0.137,
-		0.54,0.137,0.137,
-		0.54,0.137,0.137,
-		0.54,0.137,0.137,
-		0.54,0.137,0.137,	
-		0.54,0.137,0.137,
-		0.54,0.137,0.137,
-		0.54,0.137,0.137,
-		0.54,0.137,0.137,
-
-		0.54,0.137,0.137,
-		0.54,0.137,0.137,
-		0.54,0.137,0.137
-			/*  0.5,0.15,0.05,// color 1
-			    0.5,0.15,0.05,// color 2
-			    0.6,0.4,0.12, // color 3
-
-			    0.6,0.4,0.12, // color 3
-			    0.6,0.4,0.12, // color 4
-			    0.5,0.15,0.05,  // color 1
-
-
-
-			    0.6,0.4,0.12, // 1
-			    0.6,0.4,0.12, // color 4
-			    0.5,0.15,0.05,//5
-
-			    0.6,0.4,0.12, // 5
-			    0.6,0.4,0.12, // color 6
-			    0.5,0.15,0.05//1*/
-			//139 35 35 
-	};
-
-	// create3DObject creates and returns a handle to a VAO that can be used later
-	basecannon = create3DObject(GL_TRIANGLES, 12, vertex_buffer_data, color_buffer_data, GL_FILL);
-}
-
-
-/* static const GLfloat vertex_buffer_data [] = {
-   -1.2,-1,0, // vertex 1
-   1.2,-1,0, // vertex 2
-   1.2, 1,0, // vertex 3
-
-   1.2, 1,0, // vertex 3
-   -1.2, 1,0, // vertex 4
-   -1.2,-1,0  // vertex 1
-   };
-
-   static const GLfloat color_buffer_data [] = {
-   1,0,0, // color 1
-   0,0,1, // color 2
-   0,1,0, // color 3
-
-   0,1,0, // color 3
-   0.3,0.3,0.3, // color 4
-   1,0,0  // color 1
-   };
-
-// create3DObject creates and returns a handle to a VAO that can be used later
-circle = create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
-} */
-
-
-
-/* Render the scene with openGL */
-/* Edit this function according to your assignment */
-void draw ()
-{
-	Matrices.projection = glm::ortho(lefthor, righthor, vertdown, vertup, 0.1f, 500.0f);
-	// clear the color and depth in the frame buffer
-	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	// use the loaded shader program
-	// Don't change unless you know what you are doing
-	glUseProgram (programID);
-
-	// Eye - Location of camera. Don't change unless you are sure!!
-	glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
-	// Target - Where is the camera looking at.  Don't change unless you are sure!!
-	glm::vec3 target (0, 0, 0);
-	// Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
-	glm::vec3 up (0, 1, 0);
-
-	// Compute Camera matrix (view)
-	// Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
-	//  Don't change unless you are sure!!
-	Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
-
-	// Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
-	//  Don't change unless you are sure!!
-	glm::mat4 VP = Matrices.projection * Matrices.view;
-
-	// Send our transformation to the currently bound shader, in the "MVP" uniform
-	// For each model you render, since the MVP will be different (at least the M part)
-	//  Don't change unless you are sure!!
-	glm::mat4 MVP;	// MVP = Projection * View * Model
-
-
-
-
-
-	Matrices.model = glm::mat4(1.0f);
-
-	//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatedownback = glm::translate (glm::vec3(0,0,0));        // glTranslatef
-	// rotate about vector (-1,1,1)
-	Matrices.model *= translatedownback; //* rotateRectangle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(downback);
-
-
-
-	Matrices.model = glm::mat4(1.0f);
-
-	//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateupback = glm::translate (glm::vec3(0,0,0));        // glTranslatef
-	// rotate about vector (-1,1,1)
-	Matrices.model *= translateupback; //* rotateRectangle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(upback);
-
-
-
-	Matrices.model = glm::mat4(1.0f);
-
-	//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatebrown = glm::translate (glm::vec3(0,0,0));        // glTranslatef
-	// rotate about vector (-1,1,1)
-	Matrices.model *= translatebrown; //* rotateRectangle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(downfull);
-
-
-
-	/* Matrices.model = glm::mat4(1.0f);
-
-	//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatetrees = glm::translate (glm::vec3(-790, 300, 0));        // glTranslatef
-	// rotate about vector (-1,1,1)
-	Matrices.model *= translatetrees; //* rotateRectangle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(tree1);*/
-
-	Matrices.model = glm::mat4(1.0f);
-
-	//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatetrees2 = glm::translate (glm::vec3(-610, 300, 0));        // glTranslatef
-	// rotate about vector (-1,1,1)
-	Matrices.model *= translatetrees2; //* rotateRectangle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(tree2);
-
-	Matrices.model = glm::mat4(1.0f);
-
-	//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatetrees3 = glm::translate (glm::vec3(-735, 325, 0));        // glTranslatef
-	// rotate about vector (-1,1,1)
-	Matrices.model *= translatetrees3; //* rotateRectangle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(tree3);
-
-	Matrices.model = glm::mat4(1.0f);
-
-	//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatetrees4 = glm::translate (glm::vec3(-735, 275, 0));        // glTranslatef
-	// rotate about vector (-1,1,1)
-	Matrices.model *= translatetrees4; //* rotateRectangle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(tree4);
-
-	Matrices.model = glm::mat4(1.0f);
-
-	//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatetrees5 = glm::translate (glm::vec3(-670, 325, 0));        // glTranslatef
-	// rotate about vector (-1,1,1)
-	Matrices.model *= translatetrees5; //* rotateRectangle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(tree5);
-
-
-
-
-
-	Matrices.model = glm::mat4(1.0f);
-
-	//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatecan = glm::translate (glm::vec3(-900,-300, 0));        // glTranslatef
-	// rotate about vector (-1,1,1)
-	Matrices.model *= translatecan; //* rotateRectangle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(basecannon);
-
-	Matrices.model = glm::mat4(1.0f);
-
-	//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatehill = glm::translate (glm::vec3(450,-300, 0));        // glTranslatef
-	// rotate about vector (-1,1,1)
-	Matrices.model *= translatehill; //* rotateRectangle;
-	MVP = VP * Matrices.model;
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-
-	// draw3DObject draws the VAO given to it using current MVP matrix
-	draw3DObject(hill);
-
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 translateTriangle = glm::translate (glm::vec3(-800.0f, -140.0f, 0.0f)); // glTranslatef
-	//glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-
-	glm::mat4 TriangleTransform = translateTriangle; //* rotateTriangle;
-
-	Matrices.model *= TriangleTransform; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
-
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(triangle);
-
-
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 translatepig = glm::translate (glm::vec3(890.0f, -210.0f, 0.0f)); // glTranslatef
-	//glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-
-	/*glm::mat4 Transformpig = translatepig; //* rotateTriangle;
-
-	  Matrices.model *= Transformpig; 
-	  MVP = VP * Matrices.model; // MVP = p * V * M
-
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(pig1);*/ 
-
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 translateblock1 = glm::translate (glm::vec3(870.0f, -300.0f, 0.0f)); // glTranslatef
-	//glm::mat4 rotateTriangle = glm::rotate((float)(triangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-
-	glm::mat4 Transformblock1 = translateblock1; //* rotateTriangle;
-
-	Matrices.model *= Transformblock1; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
-
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block1); 
-
-	Matrices.model = glm::mat4(1.0f);
-	// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateblock2 = glm::translate (glm::vec3(830.0f, -280.0f, 0.0f)); // glTranslatef
-
-
-	glm::mat4 Transformblock2 = translateblock2; //* rotateblock2;
+	const GLfloat color_buffer_data [] = {
 
-	Matrices.model *= Transformblock2; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+		0.54,0.137,0.137,
+		0.54,0.137,0.137,
+		0.54,0.137,0.137,
+		0.54,0.137,0.137,
+		0.54,0.137,0.137,	
+		0.54,0.137,0.137,
+		0.54,0.137,0.137,
+		0.54,0.137,0.137,
+		0.54,0.137,0.137,
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block2); 
+		0.54,0.137,0.137,
+		0.54,0.137,0.137,
+		0.54,0.137,0.137
+			/*  0.5,0.15,0.05,// color 1
+			    0.5,0.15,0.05,// color 2
+			    0.6,0.4,0.12, // color 3
 
+			    0.6,0.4,0.12, // color 3
+			    0.6,0.4,0.12, // color 4
+			    0.5,0.15,0.05,  // color 1
 
-	Matrices.model = glm::mat4(1.0f);
-	// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateblock3 = glm::translate (glm::vec3(750.0f, -200.0f, 0.0f)); // glTranslatef
 
 
-	glm::mat4 Transformblock3 = translateblock3; //* rotateblock2;
+			    0.6,0.4,0.12, // 1
+			    0.6,0.4,0.12, // color 4
+			    0.5,0.15,0.05,//5
 
-	Matrices.model *= Transformblock3; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+			    0.6,0.4,0.12, // 5
+			    0.6,0.4,0.12, // color 6
+			    0.5,0.15,0.05//1*/
+			//139 35 35 
+	};
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block3); 
+	// create3DObject creates and returns a handle to a VAO that can be used later
+	basecannon = create3DObject(GL_TRIANGLES, 12, vertex_buffer_data, color_buffer_data, GL_FILL);
+}
 
 
-	Matrices.model = glm::mat4(1.0f);
-	// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateblock4 = glm::translate (glm::vec3(300.0f, 0.0f, 0.0f)); // glTranslatef
+/* static const GLfloat vertex_buffer_data [] = {
+   -1.2,-1,0, // vertex 1
+   1.2,-1,0, // vertex 2
+   1.2, 1,0, // vertex 3
 
+   1.2, 1,0, // vertex 3
+   -1.2, 1,0, // vertex 4
+   -1.2,-1,0  // vertex 1
+   };
 
-	glm::mat4 Transformblock4 = translateblock4; //* rotateblock2;
+   static const GLfloat color_buffer_data [] = {
+   1,0,0, // color 1
+   0,0,1, // color 2
+   0,1,0, // color 3
 
-	Matrices.model *= Transformblock4; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+   0,1,0, // color 3
+   0.3,0.3,0.3, // color 4
+   1,0,0  // color 1
+   };
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block4); 
+// create3DObject creates and returns a handle to a VAO that can be used later
+circle = create3DObject(GL_TRIANGLE_FAN, 360, vertex_buffer_data, color_buffer_data, GL_FILL);
+} */
 
 
-	Matrices.model = glm::mat4(1.0f);
-	// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateblock5 = glm::translate (glm::vec3(550.0f,-200.0f, 0.0f)); // glTranslatef
 
+/* Switch to the program a mesh is drawn with and return its ModelIndex uniform */
+GLuint useShader (int shader)
+{
+	bindProgram ((shader == ELLIPSE_SHADER) ? ellipseProgramID : programID);
+	return (shader == ELLIPSE_SHADER) ? Matrices.EllipseModelIndexID : Matrices.ModelIndexID;
+}
 
-	glm::mat4 Transformblock5 = translateblock5; //* rotateblock2;
+/* Depth layers - every draw gets its own depth in painter order, so opaque geometry can be drawn
+ * front to back (hidden fragments fail the depth test early) and still come out as painted.
+ * The categories only group the fill counters */
+enum { LAYER_BACKGROUND, LAYER_SCENERY, LAYER_OBJECTS, LAYER_HUD, NUM_LAYERS };
+const char* layerNames [NUM_LAYERS] = { "background", "scenery", "objects", "hud" };
+
+/* World z of painter position n - the camera sits at z=3 and sees down to z=-497 */
+#define LAYER_DEPTH(n) (-400.0f + (n)*0.1f)
+
+/* One queued draw - recorded in painter order during draw(), issued sorted by flushDrawQueue() */
+struct DrawCommand {
+	int Order;          // painter position, higher is nearer
+	int Layer;          // LAYER_*
+	int Shader;
+	int ModelIndex;
+	GLuint VertexArray;
+	GLenum PrimitiveMode;
+	GLenum FillMode;
+	GLint First;
+	GLsizei Count;
+	GLsizei Instances;  // 0 for a plain draw
+};
+typedef struct DrawCommand DrawCommand;
 
-	Matrices.model *= Transformblock5; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+vector<DrawCommand> drawQueue;
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block5); 
+void queueDraw (int layer, int shader, int model_index, GLuint vertex_array, GLenum primitive_mode, GLenum fill_mode, GLint first, GLsizei count, GLsizei instances=0)
+{
+	DrawCommand command = { (int)drawQueue.size(), layer, shader, model_index, vertex_array, primitive_mode, fill_mode, first, count, instances };
+	drawQueue.push_back(command);
+}
 
-	Matrices.model = glm::mat4(1.0f);
-	// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateblock6 = glm::translate (glm::vec3(400.0f, -300.0f, 0.0f)); // glTranslatef
+/* Queue the VBOs handled by VAO */
+void queueDraw3DObject (int layer, struct VAO* vao, int model_index=0)
+{
+	if(vao == NULL)
+		return;
+	queueDraw(layer, vao->Shader, model_index, vao->VertexArrayID, vao->PrimitiveMode, vao->FillMode, 0, vao->NumVertices);
+}
 
+/* Queue the first numInstances instances of the VAO as one draw */
+void queueDraw3DObjectInstanced (int layer, struct VAO* vao, int numInstances)
+{
+	if (numInstances > vao->MaxInstances)
+		numInstances = vao->MaxInstances;
+	if (numInstances <= 0)
+		return;
+	queueDraw(layer, vao->Shader, 0, vao->VertexArrayID, vao->PrimitiveMode, vao->FillMode, 0, vao->NumVertices, numInstances);
+}
 
-	glm::mat4 Transformblock6 = translateblock6; //* rotateblock2;
+/* Samples passed per layer, from GL_SAMPLES_PASSED queries read back QUERY_FRAMES frames later */
+#define QUERY_FRAMES 3
 
-	Matrices.model *= Transformblock6; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+struct FillStats {
+	vector<GLuint> Queries[QUERY_FRAMES];
+	vector<int> Layers[QUERY_FRAMES]; // layer counted by each query issued in that frame
+	int Frame;
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block6); 
+	double Samples[NUM_LAYERS];
+	long Frames;
+	long Skipped; // frames whose results were not back in time, left out rather than waited for
+} fillStats;
 
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 rotateblock7 = glm::rotate((float)(block7_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateblock7 = glm::translate (glm::vec3(150.0f, -200.0f, 0.0f)); // glTranslatef
+/* Collect the oldest frame's queries so their objects can be reused - a frame that is not finished
+ * yet is dropped, waiting on GL_QUERY_RESULT would stall this one until the driver catches up */
+void beginFillFrame ()
+{
+	int slot = fillStats.Frame % QUERY_FRAMES;
+	vector<int> &layers = fillStats.Layers[slot];
+	if(layers.empty())
+		return;
 
+	for(int i=0;i<(int)layers.size();i++)
+	{
+		GLint available;
+		glGetQueryObjectiv(fillStats.Queries[slot][i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if(!available)
+		{
+			fillStats.Skipped++;
+			layers.clear();
+			return;
+		}
+	}
+	for(int i=0;i<(int)layers.size();i++)
+	{
+		GLuint samples = 0;
+		glGetQueryObjectuiv(fillStats.Queries[slot][i], GL_QUERY_RESULT, &samples);
+		fillStats.Samples[layers[i]] += samples;
+	}
+	fillStats.Frames++;
+	layers.clear();
+}
 
-	glm::mat4 Transformblock7 = translateblock7 * rotateblock7;
+/* Start counting the samples of a new run of draws in the given layer */
+void beginFillQuery (int layer)
+{
+	int slot = fillStats.Frame % QUERY_FRAMES;
+	vector<GLuint> &queries = fillStats.Queries[slot];
+	vector<int> &layers = fillStats.Layers[slot];
+	if(layers.size() == queries.size())
+	{
+		GLuint query;
+		glGenQueries(1, &query);
+		queries.push_back(query);
+	}
+	glBeginQuery(GL_SAMPLES_PASSED, queries[layers.size()]);
+	layers.push_back(layer);
+}
 
-	Matrices.model *= Transformblock7; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+void printFillStats ()
+{
+	if(fillStats.Frames == 0)
+		return;
+	cout << "Samples passed per frame:";
+	for(int i=0;i<NUM_LAYERS;i++)
+		cout << " " << layerNames[i] << "=" << fillStats.Samples[i]/fillStats.Frames;
+	cout << " (" << fillStats.Frames << " frames, " << fillStats.Skipped << " skipped)" << '\n';
+}
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block7); 
+/* Issue everything queued this frame - the queue is in painter order, so the opaque (flat) draws
+ * go out walking it backwards, nearest first, then the anti-aliased ellipses forwards over them */
+void flushDrawQueue ()
+{
+	TRACE_SCOPE("flushDrawQueue");
+	int n = drawQueue.size();
+	vector<int> order;
+	for(int i=n-1;i>=0;i--)
+		if(drawQueue[i].Shader == FLAT_SHADER)
+			order.push_back(i);
+	for(int i=0;i<n;i++)
+		if(drawQueue[i].Shader != FLAT_SHADER)
+			order.push_back(i);
+
+	beginFillFrame();
+	int layer = -1;
+	for(int i=0;i<(int)order.size();i++)
+	{
+		DrawCommand &command = drawQueue[order[i]];
+		TRACE_SCOPE(layerNames[command.Layer]);
 
+		// One query per run of draws in the same layer
+		if(command.Layer != layer)
+		{
+			if(layer >= 0)
+				glEndQuery(GL_SAMPLES_PASSED);
+			beginFillQuery(command.Layer);
+			layer = command.Layer;
+		}
 
-	Matrices.model = glm::mat4(1.0f);
-	// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateblock8 = glm::translate (glm::vec3(190.0f, -300.0f, 0.0f)); // glTranslatef
+		glUniform1i(useShader(command.Shader), command.ModelIndex);
+		glUniform1f((command.Shader == ELLIPSE_SHADER) ? Matrices.EllipseDepthID : Matrices.DepthID, LAYER_DEPTH(command.Order));
+		setPolygonMode (command.FillMode);
+		bindVertexArray (command.VertexArray);
+		if(command.Instances > 0)
+			glDrawArraysInstanced(command.PrimitiveMode, command.First, command.Count, command.Instances);
+		else
+			glDrawArrays(command.PrimitiveMode, command.First, command.Count);
+	}
+	if(layer >= 0)
+		glEndQuery(GL_SAMPLES_PASSED);
+	fillStats.Frame++;
 
+	drawQueue.clear();
+}
 
-	glm::mat4 Transformblock8 = translateblock8; //* rotateblock2;
+/* out = M * in + T for n points, M column major - strides are in bytes, in and out may be the same points */
+void transformPoints (const GLfloat* in, size_t in_stride, GLfloat* out, size_t out_stride, int n, const float m[4], float tx, float ty)
+{
+	int i = 0;
+#ifdef __SSE2__
+	// Two points per iteration, packed as (x0,y0,x1,y1)
+	const __m128 col0 = _mm_setr_ps(m[0], m[1], m[0], m[1]);
+	const __m128 col1 = _mm_setr_ps(m[2], m[3], m[2], m[3]);
+	const __m128 translate = _mm_setr_ps(tx, ty, tx, ty);
+	for (; i+1<n; i+=2) {
+		const GLfloat* a = (const GLfloat*)((const char*)in + i*in_stride);
+		const GLfloat* b = (const GLfloat*)((const char*)a + in_stride);
+		__m128 p = _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64*)a), (const __m64*)b);
+		__m128 xs = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2,2,0,0));
+		__m128 ys = _mm_shuffle_ps(p, p, _MM_SHUFFLE(3,3,1,1));
+		__m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(xs, col0), _mm_mul_ps(ys, col1)), translate);
+		GLfloat* outa = (GLfloat*)((char*)out + i*out_stride);
+		GLfloat* outb = (GLfloat*)((char*)outa + out_stride);
+		_mm_storel_pi((__m64*)outa, r);
+		_mm_storeh_pi((__m64*)outb, r);
+	}
+#endif
+	for (; i<n; i++) {
+		const GLfloat* a = (const GLfloat*)((const char*)in + i*in_stride);
+		GLfloat* o = (GLfloat*)((char*)out + i*out_stride);
+		GLfloat px = a[0], py = a[1];
+		o[0] = m[0]*px + m[2]*py + tx;
+		o[1] = m[1]*px + m[3]*py + ty;
+	}
+}
 
-	Matrices.model *= Transformblock8; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+/* Number of vertices, and which source vertex goes where, when a mesh is turned into a plain triangle list */
+int triangleListSize (GLenum primitive_mode, int numVertices)
+{
+	if(primitive_mode == GL_TRIANGLES)
+		return numVertices;
+	return max(numVertices-2, 0)*3;
+}
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block8); 
+int triangleListIndex (GLenum primitive_mode, int i)
+{
+	int triangle = i/3, corner = i%3;
+	if(primitive_mode == GL_TRIANGLE_STRIP)
+		return triangle + corner;
+	if(primitive_mode == GL_TRIANGLE_FAN)
+		return (corner == 0) ? 0 : triangle + corner;
+	return i;
+}
 
+/* Multiply a packed color by a tint */
+void tintColor (GLubyte color[4], const glm::vec3 &tint)
+{
+	color[0] = packColor(color[0]/255.0f * tint.x);
+	color[1] = packColor(color[1]/255.0f * tint.y);
+	color[2] = packColor(color[2]/255.0f * tint.z);
+}
 
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 rotateblock9 = glm::rotate((float)((block9_rotate)*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateblock9 = glm::translate (glm::vec3(iniblock9,iniblock9ver, 0.0f)); // glTranslatef
+/* Consecutive submissions drawn by one glDrawArrays */
+struct SpriteRun {
+	int Shader;
+	GLenum FillMode;
+	GLint First;
+	GLsizei Count;
+};
+typedef struct SpriteRun SpriteRun;
 
+/* Sprite batch - meshes are submitted with a transform and a tint, transformed on the CPU into the
+ * stream buffer as triangle lists and drawn at flush with one draw per run of the same program */
+struct SpriteBatch {
+	vector<SpriteRun> Runs;
+	vector<Vertex> Scratch;
+	vector<StreamEllipseVertex> EllipseScratch;
 
-	glm::mat4 Transformblock9 = translateblock9 * rotateblock9;
+	// Sprites submitted and draws issued, this frame and since start
+	long Sprites, Draws;
+	long TotalSprites, TotalDraws;
+	long Frames;
 
-	Matrices.model *= Transformblock9; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+	SpriteBatch () : Sprites(0), Draws(0), TotalSprites(0), TotalDraws(0), Frames(0) {}
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block9); 
+	/* Start a frame - maps the next stream slice */
+	void begin ()
+	{
+		beginStreamFrame();
+		Runs.clear();
+	}
 
+	/* Queue a mesh, rotated by rotation degrees about z and scaled about its origin. Returns false if the stream slice is full */
+	bool submit (struct VAO* mesh, glm::vec2 position, float rotation=0, glm::vec2 scale=glm::vec2(1.0f), glm::vec3 colour=glm::vec3(1.0f))
+	{
+		float c = cos(rotation*M_PI/180.0f);
+		float s = sin(rotation*M_PI/180.0f);
+		bool tinted = (colour.x != 1 || colour.y != 1 || colour.z != 1);
+		int count = triangleListSize(mesh->PrimitiveMode, mesh->NumVertices);
+		GLint first;
 
-	Matrices.model = glm::mat4(1.0f);
-	glm::mat4 rotateblock10 = glm::rotate((float)(block10_rotate*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateblock10 = glm::translate (glm::vec3(iniblock10, iniblock10ver, 0.0f)); // glTranslatef
+		if(mesh->Shader == FLAT_SHADER)
+		{
+			Vertex* out = (Vertex*)streamAlloc(count, sizeof(Vertex), &first);
+			if(out == NULL)
+				return false;
+
+			// Transform in cached memory, then write the stream slice front to back only
+			const float rs [] = { c*scale.x, s*scale.x, -s*scale.y, c*scale.y };
+			Scratch.assign(mesh->Vertices.begin(), mesh->Vertices.end());
+			transformPoints(&Scratch[0].x, sizeof(Vertex), &Scratch[0].x, sizeof(Vertex), mesh->NumVertices, rs, position.x, position.y);
+			for (int i=0; tinted && i<mesh->NumVertices; i++)
+				tintColor(Scratch[i].color, colour);
+			for (int i=0; i<count; i++)
+				out[i] = Scratch[triangleListIndex(mesh->PrimitiveMode, i)];
+		}
+		else
+		{
+			StreamEllipseVertex* out = (StreamEllipseVertex*)streamAlloc(count, sizeof(StreamEllipseVertex), &first);
+			if(out == NULL)
+				return false;
+
+			// Scale goes into the corner and the radii, rotation and translation into the offset :
+			// corner + offset = R * corner + position
+			const float sc [] = { scale.x, 0, 0, scale.y };
+			const float r [] = { c-1, s, -s, c-1 };
+			EllipseScratch.resize(mesh->NumVertices);
+			for (int i=0; i<mesh->NumVertices; i++) {
+				EllipseScratch[i].Quad = mesh->Ellipses[i];
+				EllipseScratch[i].Quad.rx *= fabs(scale.x);
+				EllipseScratch[i].Quad.ry *= fabs(scale.y);
+				if(tinted) {
+					tintColor(EllipseScratch[i].Quad.color, colour);
+					tintColor(EllipseScratch[i].Quad.color2, colour);
+				}
+			}
+			StreamEllipseVertex* v = &EllipseScratch[0];
+			transformPoints(&v->Quad.x, sizeof(StreamEllipseVertex), &v->Quad.x, sizeof(StreamEllipseVertex), mesh->NumVertices, sc, 0, 0);
+			transformPoints(&v->Quad.x, sizeof(StreamEllipseVertex), &v->ox, sizeof(StreamEllipseVertex), mesh->NumVertices, r, position.x, position.y);
+			for (int i=0; i<count; i++)
+				out[i] = EllipseScratch[triangleListIndex(mesh->PrimitiveMode, i)];
+		}
 
+		// Same program and fill mode, and right behind the previous run in the slice - just grow it
+		SpriteRun *last = Runs.empty() ? NULL : &Runs.back();
+		if(last && last->Shader == mesh->Shader && last->FillMode == mesh->FillMode && last->First + last->Count == first)
+			last->Count += count;
+		else {
+			SpriteRun run = { mesh->Shader, mesh->FillMode, first, count };
+			Runs.push_back(run);
+		}
+		Sprites++;
+		return true;
+	}
 
-	glm::mat4 Transformblock10 = translateblock10 * rotateblock10;
+	/* Unmap the slice and queue a draw for every run submitted since begin() */
+	void flush (int layer)
+	{
+		endStreamWrites();
+		for (int i=0; i<(int)Runs.size(); i++) {
+			SpriteRun &run = Runs[i];
+			GLuint vertex_array = (run.Shader == ELLIPSE_SHADER) ? stream.EllipseArray : stream.FlatArray;
+			queueDraw(layer, run.Shader, 0, vertex_array, GL_TRIANGLES, run.FillMode, run.First, run.Count); // already in world space (draw id 0)
+		}
+		Draws += Runs.size();
+		Runs.clear();
+
+		TotalSprites += Sprites;
+		TotalDraws += Draws;
+		Frames++;
+		Sprites = 0;
+		Draws = 0;
+	}
+} spriteBatch;
 
-	Matrices.model *= Transformblock10; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+void printSpriteStats ()
+{
+	if(spriteBatch.Frames == 0)
+		return;
+	cout << "Sprite batch per frame: sprites=" << (double)spriteBatch.TotalSprites/spriteBatch.Frames;
+	cout << " draws=" << (double)spriteBatch.TotalDraws/spriteBatch.Frames << '\n';
+}
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block10);
+int ecannon,ebird,esmoke,esparks;
+int blockBodies [TOWER_BLOCKS];
 
-	Matrices.model = glm::mat4(1.0f);
-	// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translateblock11 = glm::translate (glm::vec3(iniblock11, iniblock11ver, 0.0f)); // glTranslatef
+/* Lay out the level in draw order - objects added later are drawn on top */
+void createStaticEntities ()
+{
+	TRACE_SCOPE("createStaticEntities");
+	// Scenery - never moves, baked into the static batches
+	addStaticEntity(downback, 0, 0, true);
+	addStaticEntity(upback, 0, 0, true);
+	addStaticEntity(downfull, 0, 0, true);
+	addStaticEntity(tree2, -610, 300);
+	addStaticEntity(tree3, -735, 325);
+	addStaticEntity(tree4, -735, 275);
+	addStaticEntity(tree5, -670, 325);
+	addStaticEntity(basecannon, -900, -300);
+	addStaticEntity(hill, 450, -300);
+	addStaticEntity(triangle, -800, -140);
+	createStaticBatch(backgroundEntities, backgroundBatch, backgroundEllipseBatch);
+	createStaticBatch(staticEntities, staticBatch, staticEllipseBatch);
+}
 
+enum { BODY_GROUND, BODY_BLOCK, BODY_PIG, BODY_BIRD };
 
-	glm::mat4 Transformblock11 = translateblock11; //* rotateblock2;
+#define BLOCK_DENSITY 1.0f
+#define PIG_DENSITY 0.5f
+#define BIRD_DENSITY 2.0f
+/* The trapezia stand on the 45 degree sides of the hill, which has to grip them harder than tan(45) = 1 */
+#define HILL_FRICTION 3.0f
 
-	Matrices.model *= Transformblock11; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+/* A tower block - the body is made from the same outline as the mesh */
+int addBlock (VAO* mesh, const BlockDef &block)
+{
+	glm::vec2 corners[4];
+	for(int i=0;i<4;i++)
+		corners[i] = glm::vec2(block.X + block.Outline[2*i], block.Y + block.Outline[2*i+1]);
+	int id = addPolygonBody(corners, 4, BLOCK_DENSITY);
+	Body &body = bodies[id];
+	body.Kind = BODY_BLOCK;
+	body.EntityId = addEntity(mesh, block.X, block.Y);
+	body.Pivot = glm::vec2(block.X, block.Y) - bodyPosition(id);
+	setEntityStreamed(body.EntityId);
+	return id;
+}
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(block11); 
+/* Pigs roll as circles as tall as their mesh, so they sit right on their blocks */
+int addPig (VAO* mesh, const PigDef &pig)
+{
+	int id = addCircleBody(pig.RadiusY, glm::vec2(pig.X, pig.Y), PIG_DENSITY);
+	Body &body = bodies[id];
+	body.Kind = BODY_PIG;
+	body.Restitution = 0.2f;
+	body.EntityId = addEntity(mesh, pig.X, pig.Y);
+	setEntityStreamed(body.EntityId);
+	return id;
+}
 
-	Matrices.model = glm::mat4(1.0f);
-	// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatepig2 = glm::translate (glm::vec3(inipig2hor, inipig2ver, 0.0f)); // glTranslatef
+/* --stress : this many small blocks dropped right of the tower, awake and not drawn, to time the physics on a big level */
+int stressBlocks = 0;
+#define STRESS_COLUMNS 60
+/* Headless stress runs go on for this many seconds of ticks, long after the blocks have settled and gone to sleep */
+#define STRESS_RUN_TIME 30
 
+void addStressBlock (int i)
+{
+	glm::vec2 corner(1000 + (i%STRESS_COLUMNS)*25, -295 + (i/STRESS_COLUMNS)*25);
+	glm::vec2 corners[4] = { corner, corner + glm::vec2(20, 0), corner + glm::vec2(20, 20), corner + glm::vec2(0, 20) };
+	int id = addPolygonBody(corners, 4, BLOCK_DENSITY);
+	bodies[id].Kind = BODY_BLOCK;
+	setBodyAwake(id, true);
+}
 
-	glm::mat4 Transformpig2 = translatepig2; //* rotateblock2;
+/* Everything the simulation moves - only stores the mesh pointers, so headless runs create these without meshes */
+void createEntities ()
+{
+	TRACE_SCOPE("createEntities");
+	// The ground and the hill only collide - the scenery draws them
+	glm::vec2 ground[4] = { glm::vec2(-3000, -400), glm::vec2(3000, -400), glm::vec2(3000, -300), glm::vec2(-3000, -300) };
+	bodies[addPolygonBody(ground, 4, 0)].Kind = BODY_GROUND;
+	glm::vec2 slope[3] = { glm::vec2(450, -300), glm::vec2(850, -300), glm::vec2(650, -100) };
+	int hill = addPolygonBody(slope, 3, 0);
+	bodies[hill].Kind = BODY_GROUND;
+	bodies[hill].Friction = HILL_FRICTION;
+
+	// Tower - every body starts out at rest until something hits it, though it stands awake too (--check-tower)
+	for(int i=0;i<TOWER_BLOCKS;i++)
+		blockBodies[i] = addBlock(blocks[i], towerBlocks[i]);
+	for(int i=0;i<TOWER_PIGS;i++)
+		addPig(pigs[i], towerPigs[i]);
+	for(int i=0;i<stressBlocks;i++)
+		addStressBlock(i);
+
+	// Cannon, bird and effects
+	ecannon = addEntity(rectangle, -840, -140, rectangle_rotation);
+	birdBody = addCircleBody(40, glm::vec2(x, y), BIRD_DENSITY);
+	bodies[birdBody].Kind = BODY_BIRD;
+	bodies[birdBody].Restitution = 0.3f;
+	bodies[birdBody].Bullet = true;
+	setBodyEnabled(birdBody, false); // on the cannon
+	ebird = addEntity(circle, x, y);
+	bodies[birdBody].EntityId = ebird;
+	esmoke = addEntity(tree1, smokex, smokey, 0, smokehor, smokever);
+	addEntity(tree6, -670, 275);
+	esparks = addEntity(sparks, 650, 40);
+
+	// Whatever moves during a shot goes through the stream buffer
+	setEntityStreamed(ebird);
+	setEntityStreamed(esparks);
+}
 
-	Matrices.model *= Transformpig2; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+/* Copy the game state into the render table */
+void updateEntities ()
+{
+	for(int i=0;i<(int)bodies.size();i++)
+		syncBodyEntity(i);
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(pig2); 
+	setEntityTransform(ecannon, -840, -140, rectangle_rotation);
+	// Between shots the bird waits at the muzzle
+	if(flag == 0)
+	{
+		setEntityTransform(ebird, x, y);
+		setEntityVisible(ebird, true);
+	}
+	setEntityTransform(esmoke, smokex, smokey, 0, smokehor, smokever);
 
+	setEntityVisible(esparks, sparkslit == 1);
+}
 
-	Matrices.model = glm::mat4(1.0f);
-	// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatepig4 = glm::translate (glm::vec3(inipig4hor, inipig4ver, 0.0f)); // glTranslatef
+/* Flight time the game advances per 60Hz tick - other tick rates take shorter or longer steps, so the game keeps its speed */
+#define SHOT_TIME_STEP 0.1f
 
+/* Ticks per second, --sim-hz on the command line */
+int simHz = 60;
+#define MIN_SIM_HZ 10
+#define MAX_SIM_HZ 1000
 
-	glm::mat4 Transformpig4 = translatepig4; //* rotateblock2;
+/* Frames longer than this are cut short instead of running a burst of catch-up ticks */
+#define MAX_FRAME_TIME 0.25
 
-	Matrices.model *= Transformpig4; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+/* Game timers - scheduled in simulated seconds and run at the start of the tick they come due,
+ * so delays show up as states of the game instead of blocking the frame */
+struct GameEvent {
+	long Tick;
+	void (*Callback)(int* target);
+	int* Target; // game variable the event acts on, may be NULL
+};
+typedef struct GameEvent GameEvent;
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(pig4); 
+long simTick = 0;
+vector<GameEvent> gameEvents;
 
+void scheduleEvent (float seconds, void (*callback)(int*), int* target=NULL)
+{
+	GameEvent event = { simTick + max(lround(seconds*simHz), 1L), callback, target };
+	gameEvents.push_back(event);
+}
 
+/* Run the events due this tick, in the order they were scheduled */
+void runEvents ()
+{
+	// Callbacks may schedule new events, so take the due ones out first
+	vector<GameEvent> due;
+	for(int i=0;i<(int)gameEvents.size();)
+	{
+		if(gameEvents[i].Tick <= simTick) {
+			due.push_back(gameEvents[i]);
+			gameEvents.erase(gameEvents.begin() + i);
+		}
+		else
+			i++;
+	}
+	for(int i=0;i<(int)due.size();i++)
+		due[i].Callback(due[i].Target);
+}
 
+/* How long the missed shot stays on screen before the bird goes back on the cannon */
+#define SHOT_OVER_DELAY 0.5f
+/* How long the smoke puff of a popped pig lasts - the shot is not over before it fades */
+#define PUFF_TIME 0.25f
+/* How long the sparks stay up once the base is knocked out */
+#define SPARK_TIME (40/60.0f)
 
-	Matrices.model = glm::mat4(1.0f);
-	// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-	glm::mat4 translatepig6 = glm::translate (glm::vec3(inipig6hor, inipig6ver, 0.0f)); // glTranslatef
-	glm::mat4 Transformpig6 = translatepig6; //* rotateblock2;
+/* Bird back on the cannon, ready for the next shot */
+void resetShot (int*)
+{
+	flag = 0;
+	shotover = 0;
+	teta = tetacannon;
+	setBodyEnabled(birdBody, false);
+	bodies[birdBody].Teleported = true;
+}
 
-	Matrices.model *= Transformpig6; 
-	MVP = VP * Matrices.model; // MVP = p * V * M
+/* End of a smoke puff - the cloud goes back to the sky once the last one fades */
+void endPuff (int* puffs)
+{
+	(*puffs)--;
+	if(*puffs == 0)
+	{
+		smokex = -670;
+		smokey = 275;
+		smokehor = 0.5;
+		smokever = 0.5;
+	}
+}
 
-	//  Don't change unless you are sure!!
-	glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-	//camera_rotation_angle++; // Simulating camera rotation
-	draw3DObject(pig6); 
+void sparksOut (int*)
+{
+	sparkslit = 0;
+}
 
-	if(pig7disappear == 0)
+/* The base of the tower is gone - light the sparks the first time */
+void knockOutBase ()
+{
+	if(basegone == 0)
 	{
+		sparkslit = 1;
+		scheduleEvent(SPARK_TIME, sparksOut);
+	}
+	basegone = 1;
+}
+
+/* Fastest a pig survives being hit - the speed one step of contact impulse gives it */
+#define CRUSH_SPEED 15.0f
+/* The shot has played out once everything stays under REST_SPEED for REST_TIME of flight time */
+#define REST_SPEED 2.0f
+#define REST_TIME 1.0f
+/* A shot is over after this much flight time even if something keeps rolling */
+#define SHOT_TIMEOUT 20.0f
+/* Anything past these has left the world */
+#define WORLD_EDGE 2600
+#define WORLD_BOTTOM -1560
+
+bool outOfWorld (int id)
+{
+	return fabs(motion.X[id]) > WORLD_EDGE || motion.Y[id] < WORLD_BOTTOM;
+}
 
-		Matrices.model = glm::mat4(1.0f);
-		// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-		glm::mat4 translatepig7 = glm::translate (glm::vec3(320.0f, -260.0f, 0.0f)); // glTranslatef
-		glm::mat4 Transformpig7 = translatepig7; //* rotateblock2;
+/* A pig is gone - score it and leave a smoke puff where it was */
+void popPig (int id)
+{
+	setBodyEnabled(id, false);
+	score = score + 100;
+	smokex = motion.X[id];
+	smokey = motion.Y[id];
+	smokehor = 0.5;
+	smokever = 0.5;
+	puffing++;
+	scheduleEvent(PUFF_TIME, endPuff, &puffing);
+}
 
-		Matrices.model *= Transformpig7; 
-		MVP = VP * Matrices.model; // MVP = p * V * M
+/* What the last step did to the tower - pigs the bird touched, pigs crushed or fallen out pop,
+ * and the sparks light once one of the short verticals on the big horizontal has toppled */
+void updateTower (float dt)
+{
+	for(int i=0;i<(int)contacts.size();i++)
+	{
+		int a = contacts[i].A, b = contacts[i].B;
+		if(bodies[a].Kind == BODY_BIRD && bodies[b].Kind == BODY_PIG && bodies[b].Enabled)
+			popPig(b);
+		else if(bodies[b].Kind == BODY_BIRD && bodies[a].Kind == BODY_PIG && bodies[a].Enabled)
+			popPig(a);
+	}
+	for(int i=0;i<(int)bodies.size();i++)
+	{
+		Body &body = bodies[i];
+		if(!body.Enabled)
+			continue;
+		if(body.Kind == BODY_PIG && (body.Impulse*body.InvMass > CRUSH_SPEED || outOfWorld(i)))
+			popPig(i);
+		else if(body.Kind == BODY_BLOCK && outOfWorld(i))
+			setBodyEnabled(i, false);
+	}
+	if(fabs(motion.Angle[blockBodies[8]]) > M_PI/4 || fabs(motion.Angle[blockBodies[9]]) > M_PI/4)
+		knockOutBase();
 
-		//  Don't change unless you are sure!!
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		//camera_rotation_angle++; // Simulating camera rotation
-		draw3DObject(pig7); 
+	if(puffing > 0)
+	{
+		smokehor = smokehor + 0.1*dt/SHOT_TIME_STEP;
+		smokever = smokever + 0.1*dt/SHOT_TIME_STEP;
 	}
 
-	//  Don't change unless you are sure!!
+	if(worldAtRest(REST_SPEED))
+		restTime += dt;
+	else
+		restTime = 0;
+}
 
-	// glm::mat4 rotatecircle = glm::rotate((float)(circle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-	//glm::mat4 triangleTransform = translateTriangle; //* rotateTriangle;
+/* The bird's side of a shot - it is over once the bird has stopped or left the world, the tower has settled
+ * and the last puff has faded */
+void simulateShot (float dt)
+{
+	flightTime += dt;
+	if(bodies[birdBody].Enabled && outOfWorld(birdBody))
+		setBodyEnabled(birdBody, false);
 
-	float lifesx = 900;
-	float lifesy = 450;
-	for( int i=0; i<(10-lifes); i++)
+	if((restTime >= REST_TIME || flightTime >= SHOT_TIMEOUT) && puffing == 0)
 	{
-
-		Matrices.model = glm::mat4(1.0f);
-		//glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-		glm::mat4 translatelifes = glm::translate (glm::vec3((lifesx-(i*50)),lifesy,0));        // glTranslatef
-		// rotate about vector (-1,1,1)
-		Matrices.model *= translatelifes;// * rotateRectangle;
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		// draw3DObject draws the VAO given to it using current MVP matrix
-		draw3DObject(lifecircle);
+		lifes = lifes+1;
+		shotover = 1;
+		scheduleEvent(SHOT_OVER_DELAY, resetShot);
 	}
-	if(flag == 1)
-	{
+}
 
-		currenttime = glfwGetTime();
-		while(timedur <= 0.1)
-		{
-			currenttime = glfwGetTime();
-			timedur+= currenttime - starttime;
-		}
-		if(timedur > 0.1)	
-			timedur = 0.1;
-		t = timedur + t;
-		//cout << t << '\n';
-		timedur = 0;
-		//cout << starttime - currenttime << '\n';
-		horblock = x+r;
-		vertblock = y+z;
-		r =  t * u * cos(DEG2RAD(teta))*e ;
-		z = u*(sin(DEG2RAD(teta)))*t - (4.9*t*t);
-		q = x+r;
-		p = mod(y+z);
-		float iniy9;
-		float iniy10;
-		if(iniblock9 <= 300 && flaggy9 == 0 && yay2==0 && block9fall!=1)
-		{
-			block9died = 1;
-			block9finish = 1;
-			if(times9 == 0)
-			{
-				t9 = 0;
-				iniy9 = iniblock9ver;
-				iniproy9 = iniblock9;
-				times9 = 1;
-				block9_rotate = 0;
-			}
-			t9 = t9+0.1;
+/* The replay has nothing left to feed and the game has come to rest - putting the bird of the last shot
+ * back on the cannon can still bring down whatever leant on it */
+bool replayFinished ()
+{
+	return replaying && replayNext == replayInputs.size() && flag == 0 && gameEvents.empty() && restTime >= REST_TIME;
+}
 
-			if(iniblock9ver + 300 <= 5 && iniblock9ver + 300 >= -5 )
-			{
-				flaggy9 = 1;
-				block9_rotate = 180 - block9_rotate;
-				iniblock9ver = -300;
-			}
-			else
-			{
-				block9finish = 1;
-				iniblock9ver = iniy9 - (4.9*t9*t9);
-				block9_rotate++;
-				iniblock9 = iniproy9 + u*cos(DEG2RAD(180))*0.2*t9;
-			}
-			//	cout << block9finish << '\n';
-
-			//	cout << flaggy9 << " flaggy " << '\n';
-			//cout << "iniproy9" << iniproy9 << '\n';
-			//cout << "iniblock9=" << iniblock9 << '\n';
-			//cout << "iniblock9ver " << iniblock9ver << '\n';
-			//cout << "iniy9" << iniy9 << '\n';
-			//	cout << block9_rotate << '\n';
-		}
+/* Advance the game by one fixed step due at time - the entity table keeps the state before and after it */
+void tick (double time)
+{
+	TRACE_SCOPE("tick");
+	beginEntityTick();
+	if(replaying)
+		feedReplay(simTick, time);
+	drainInput(simTick, time);
+	runEvents();
+	float dt = SHOT_TIME_STEP*60/simHz;
+	stepWorld(dt);
+	updateTower(dt);
+	if(flag == 1 && shotover == 0)
+		simulateShot(dt);
+	updateEntities();
+	simTick++;
+}
 
-		if(flaggy9 == 1){
-			//	block9_rotate = 0;
-			block9finish = 0;
-		}
-		if(iniblock10 <= 300 && flaggy10 == 0 && yay==0 && block10fall!=1)
-		{
-			block10died = 1;
-			block10finish = 1;
-			if(times10 == 0)
-			{
-				t10 = 0;
-				iniproy10 = iniblock10;
-				iniy10 = iniblock10ver;
-				times10 = 1;
-				block10_rotate = 0;
-			}
-			t10 = t10+0.1;
+/* What the renderer needs from one tick - written by the simulation, read by draw() */
+struct Snapshot {
+	vector<EntityState> Previous, Current;
+	int Flag;
+	int Lifes;
+	int Score;
+	float Power; // u, for the power meter
+	double Time; // clock time the tick stands for
+	long Tick;   // ticks run so far
+	bool ReplayDone;
+};
+typedef struct Snapshot Snapshot;
+
+/* Lock-free triple buffer - the simulation fills Back while the renderer reads Front, and the
+ * newest finished snapshot waits in Middle. Publishing and picking up swap slot indices atomically;
+ * SNAPSHOT_FRESH marks a Middle the renderer has not taken yet */
+#define SNAPSHOT_FRESH 4
+
+struct SnapshotBuffer {
+	Snapshot Slots[3];
+	atomic<int> Middle;
+	int Back;  // simulation thread only
+	int Front; // render thread only
+} snapshots;
+
+/* Copy the game state of the tick that just ran into the back slot */
+void writeSnapshot (double time)
+{
+	Snapshot &snapshot = snapshots.Slots[snapshots.Back];
+	snapshot.Previous = entityPrevious;
+	snapshot.Current = entityCurrent;
+	snapshot.Flag = flag;
+	snapshot.Lifes = lifes;
+	snapshot.Score = score;
+	snapshot.Power = u;
+	snapshot.Time = time;
+	snapshot.Tick = simTick;
+	snapshot.ReplayDone = replayFinished();
+}
 
-			if(iniblock10ver + 300 <= 5 && iniblock10ver + 300 >= -5 )
-			{
-				flaggy10 = 1;
-				block10_rotate = 179 - block10_rotate;
-				iniblock10ver = -300;
-			}
-			else
-			{
-				block10finish = 1;
-				iniblock10ver = iniy10 - (4.9*t10*t10);
-				block10_rotate++;
-				iniblock10 = iniproy10 + u*cos(DEG2RAD(180))*0.4*t10;
-			}
-			//	cout << iniblock10 << "   iniblock10" << '\n';
-			//cout << block10finish << '\n';
+void publishSnapshot ()
+{
+	int old = snapshots.Middle.exchange(snapshots.Back | SNAPSHOT_FRESH, memory_order_acq_rel);
+	snapshots.Back = old & 3;
+}
 
-			//cout << flaggy9 << " flaggy10 " << '\n';
+/* The newest snapshot - stays valid until the next call from the render thread */
+const Snapshot& latestSnapshot ()
+{
+	if(snapshots.Middle.load(memory_order_acquire) & SNAPSHOT_FRESH)
+	{
+		int old = snapshots.Middle.exchange(snapshots.Front, memory_order_acq_rel);
+		snapshots.Front = old & 3;
+	}
+	return snapshots.Slots[snapshots.Front];
+}
 
-		}
-		if(flaggy10 == 1){
-			//	block9_rotate = 0;
-			block10finish = 0;
-		}
-		if(pig6collide == 1)
-		{
-			//	cout << "yes" << '\n';
+/* Frame profiler - CPU time per phase of the main loop, the simulation's share from its own thread,
+ * and GPU time of each frame from GL_TIME_ELAPSED queries read back a few frames late */
+enum { PHASE_POLL, PHASE_SIM, PHASE_DRAW, PHASE_PACE, PHASE_SWAP, PHASE_COUNT };
+const char* phaseNames [PHASE_COUNT] = { "poll", "sim", "draw", "pace", "swap" };
+const float phaseColors [PHASE_COUNT][3] = { {0.5, 0.5, 0.5}, {0, 0.4, 1}, {0, 0.8, 0}, {0.85, 0.85, 0.85}, {1, 0.6, 0} };
 
-			if(times6 == 0)
-			{
-				smokex = inipig6hor;
-				smokey = inipig6ver;
-				count = 0;
-			}
+#define PROFILE_QUERIES 4
+#define PROFILE_SEGMENT_MS 0.25 // the on-screen bar is drawn in segments of this much time
+#define PROFILE_SEGMENTS 160    // per row
 
+/* One line of the CSV */
+struct ProfileFrame {
+	float Phase[PHASE_COUNT]; // ms
+	float Gpu;                // ms, negative until the query comes back
+};
+typedef struct ProfileFrame ProfileFrame;
 
-			smokehor = smokehor + 0.1;
-			smokever = smokever + 0.1;
-			/*if(vertblock <= -130 || horblock >= 400)
-			  {
-			  r = 0;
-			  z = 0;
-			  x = 360;
-			  y = -130;
-			  }*/
-			x = 2600;
-			r = 0;
-
-			count++;
-			if(count == 15)	
-			{			
-				speednotsuff = 1;
-				pig6collide = 0;
-			}
-			if(times6 == 0)
-			{
-				times6 = 1;
-				inipig6hor = 2600;
-				inipig6ver = 2600;
-			}
-		}
-		if(pig5birdcollide == 1)
-		{
-			//	cout << "yes" << '\n';
+struct Profiler {
+	atomic<long> Elapsed[PHASE_COUNT]; // ns this frame, both threads add to it
 
-			if(times5 == 0)
-			{
-				smokex = xpig5;
-				smokey = inipig5ver;
-				count = 0;
-			}
+	GLuint Queries[PROFILE_QUERIES];
+	long QueryFrame[PROFILE_QUERIES]; // frame a query measures, -1 if free
+	bool Timing;                      // a query is open for this frame
 
+	long Frame;
+	float Average[PHASE_COUNT+1]; // smoothed ms for the bar, GPU last
+	double Total[PHASE_COUNT+1];
+	long GpuFrames;
 
-			smokehor = smokehor + 0.1;
-			smokever = smokever + 0.1;
-			/*if(vertblock <= -130 || horblock >= 400)
-			  {
-			  r = 0;
-			  z = 0;
-			  x = 360;
-			  y = -130;
-			  }*/
-			x = 2600;
-			r = 0;
-
-			count++;
-			if(count == 15)	
-			{			
-				speednotsuff = 1;
-				pig5collide = 0;
-			}
-			if(times5 == 0)
-			{
-				times5 = 1;
-				xpig5 = 2600;
-				inipig5ver = 2600;
-			}
-		}
+	bool Logging;
+	vector<ProfileFrame> Frames;
+} profiler;
 
-		else if(pig7collide == 1)
-		{
-			block7_rotation--;
-			r = 0;
-			if(y >= -260)
-				y = y-10;
-			z = 0;
-			if(block7_rotation == -20)
-			{
-				//score = score+100;
-				pig7disappear = 1;
-				pig7collide = 0;
-				speednotsuff = 1;
-			}
-		}
-		else if(pig2collide == 1)
-		{
-			//	cout << "yes" << '\n';
+VAO *profileBar;
 
-			if(times2 == 0)
-			{
-				smokex = inipig2hor;
-				smokey = inipig2ver;
-				count = 0;
-			}
+/* Time the enclosing block into one phase */
+struct ProfileScope {
+	int Phase;
+	struct timespec Start;
 
-			smokehor = smokehor + 0.1;
-			smokever = smokever + 0.1;
-			/*if(vertblock <= -130 || horblock >= 400)
-			  {
-			  r = 0;
-			  z = 0;
-			  x = 360;
-			  y = -130;
-			  }*/
-			x = 2600;
-			r = 0;
-
-			count++;
-			if(count == 15)	
-			{			
-				speednotsuff = 1;
-				pig2collide = 0;
-			}
-			if(times2 == 0)
-			{
-				times2 = 1;
-				inipig2hor = 1600;
-				inipig2ver = 1600;
-			}
-		}	
-		else if(pig3birdcollide == 1)
-		{
-			//	cout << "yes" << '\n';
+	ProfileScope (int phase) : Phase(phase) { clock_gettime(CLOCK_MONOTONIC, &Start); }
+	~ProfileScope ()
+	{
+		struct timespec end;
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		profiler.Elapsed[Phase].fetch_add((end.tv_sec - Start.tv_sec)*1000000000L + (end.tv_nsec - Start.tv_nsec), memory_order_relaxed);
+	}
+};
 
-			if(times3 == 0)
-			{
-				smokex = xpig3;
-				smokey = inipig3ver;
-				count = 0;
-			}
-			smokehor = smokehor + 0.1;
-			smokever = smokever + 0.1;
-			/*if(vertblock <= -130 || horblock >= 400)
-			  {
-			  r = 0;
-			  z = 0;
-			  x = 360;
-			  y = -130;
-			  }*/
-			x = 2600;
-			r = 0;
-
-			count++;
-			if(count == 15)	
-			{			
-				speednotsuff = 1;
-				pig3birdcollide = 0;
+void createProfiler ()
+{
+	TRACE_SCOPE("createProfiler");
+	glGenQueries(PROFILE_QUERIES, profiler.Queries);
+	for(int i=0;i<PROFILE_QUERIES;i++)
+		profiler.QueryFrame[i] = -1;
+
+	// Per instance offsets and tints are filled in every frame the bar is shown
+	profileBar = createblocks(0,0,PROFILE_SEGMENT_MS*20-1,0,PROFILE_SEGMENT_MS*20-1,12,0,12,1,1,1);
+	vector<GLfloat> instance_data(5*2*PROFILE_SEGMENTS, 0);
+	createInstanceBuffer(profileBar, 2*PROFILE_SEGMENTS, &instance_data[0]);
+}
 
-			}
-			if(times3 == 0)
-			{
-				times3 = 1;
-				xpig3 = 2600;
-				inipig3ver = 2600;
-			}
-		}
-		else if(pig4collide == 1)
-		{
-			//	cout << "yes" << '\n';
+/* Open the GPU timer for this frame - skipped if its query is still in flight, reading it would stall */
+void beginGpuTimer ()
+{
+	int slot = profiler.Frame % PROFILE_QUERIES;
+	profiler.Timing = (profiler.QueryFrame[slot] < 0);
+	if(!profiler.Timing)
+		return;
+	glBeginQuery(GL_TIME_ELAPSED, profiler.Queries[slot]);
+	profiler.QueryFrame[slot] = profiler.Frame;
+}
 
-			if(times4 == 0)
-			{
-				smokex = inipig4hor;
-				smokey = inipig4ver;
-				count = 0;
-			}
+void endGpuTimer ()
+{
+	if(profiler.Timing)
+		glEndQuery(GL_TIME_ELAPSED);
+}
+
+/* Collect this frame's CPU times and whichever GPU times have come back */
+void endProfileFrame ()
+{
+	ProfileFrame frame;
+	for(int i=0;i<PHASE_COUNT;i++)
+	{
+		frame.Phase[i] = profiler.Elapsed[i].exchange(0, memory_order_relaxed) / 1e6;
+		profiler.Average[i] += (frame.Phase[i] - profiler.Average[i]) * 0.1f;
+		profiler.Total[i] += frame.Phase[i];
+	}
+	frame.Gpu = -1;
+	if(profiler.Logging)
+		profiler.Frames.push_back(frame);
 
-			smokehor = smokehor + 0.1;
-			smokever = smokever + 0.1;
-			/*if(vertblock <= -130 || horblock >= 400)
-			  {
-			  r = 0;
-			  z = 0;
-			  x = 360;
-			  y = -130;
-			  }*/
-			x = 2600;
-			r = 0;
-
-			count++;
-			if(count == 15)	
-			{			
-				speednotsuff = 1;
-				pig4collide = 0;
-			}
-			if(times4 == 0)
-			{
-				times4 = 1;
-				inipig4hor = 2600;
-				inipig4ver = 2600;
-			}	
+	for(int i=0;i<PROFILE_QUERIES;i++)
+	{
+		if(profiler.QueryFrame[i] < 0 || profiler.QueryFrame[i] == profiler.Frame)
+			continue;
+		GLint available;
+		glGetQueryObjectiv(profiler.Queries[i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if(!available)
+			continue;
+
+		GLuint64 elapsed;
+		glGetQueryObjectui64v(profiler.Queries[i], GL_QUERY_RESULT, &elapsed);
+		long measured = profiler.QueryFrame[i];
+		profiler.QueryFrame[i] = -1;
+		if(measured == 0)
+			continue; // the first query can include driver start up (llvmpipe)
+
+		float gpu = elapsed / 1e6;
+		profiler.Average[PHASE_COUNT] += (gpu - profiler.Average[PHASE_COUNT]) * 0.1f;
+		profiler.Total[PHASE_COUNT] += gpu;
+		profiler.GpuFrames++;
+		if(profiler.Logging)
+			profiler.Frames[measured].Gpu = gpu;
+	}
+	profiler.Frame++;
+}
 
-		}
-		else{
-			float diffpig6 = sqrt(pow((horblock - inipig6hor),2) + pow((vertblock - inipig6ver),2)) - 110;
-			float diffpig2 = sqrt(pow((horblock - inipig2hor),2) + pow((vertblock - inipig2ver),2)) - 90;
-			float diffpig4 = sqrt(pow((horblock - inipig4hor),2) + pow((vertblock - inipig4ver),2)) - 80;
-			float diffpig3 = sqrt(pow((horblock - xpig3),2) + pow((vertblock - inipig3ver),2)) - 90;
-			float diffpig5 = sqrt(pow((horblock - xpig5),2) + pow((vertblock - inipig5ver),2)) - 90;
-
-			if(yay2 == 1)
-			{
+/* Lay the smoothed times out as two rows of segments in the top left corner of the view - CPU phases, then GPU */
+void updateProfileBar ()
+{
+	vector<Vertex> instances(2*PROFILE_SEGMENTS);
+	int count = 0;
+	float x0 = lefthor + 20, y0 = vertup - 40;
 
-				iniblock9 -= (u * cos(DEG2RAD(teta)) * (0.05));
-				block9_rotate -= 3;
-				if(block9_rotate == -78)
-				{
-					block9fall = 1;
-					yay2 = 0;
-				}
-			}
-			if(yay == 1)
-			{
-				iniblock10 -= (u * cos(DEG2RAD(teta)) * (0.05));
-				block10_rotate -= 3;
-				if(block10_rotate == -78)
-				{
-					block10fall = 1;
-					yay = 0;
-				}
-			}
+	float end = 0;
+	for(int i=0;i<PHASE_COUNT;i++)
+	{
+		end += profiler.Average[i];
+		for(; count < PROFILE_SEGMENTS && count*PROFILE_SEGMENT_MS < end; count++)
+			setVertex(instances[count], x0 + count*PROFILE_SEGMENT_MS*20, y0, phaseColors[i][0], phaseColors[i][1], phaseColors[i][2]);
+	}
+	for(int i=0; i < PROFILE_SEGMENTS && i*PROFILE_SEGMENT_MS < profiler.Average[PHASE_COUNT]; i++)
+		setVertex(instances[count++], x0 + i*PROFILE_SEGMENT_MS*20, y0 - 16, 1, 0, 0);
 
-			if(diffpig6<=5 && diffpig6>=-5 && pig6collide==0) 
-			{
-				pig6collide = 1;
-				pig6collisioncomplete = 1;
-				score = score + 100;
-				/*	        Matrices.model = glm::mat4(1.0f);
-						glm::mat4 translatetrees = glm::translate (glm::vec3(inipig6hor, inipig6ver, 0));
-						glm :: mat4 scaletrees = glm::scale (glm::vec3(0.2,0.2,1));     // glTranslatef
-						Matrices.model *= translatetrees * scaletrees; 
-						MVP = VP * Matrices.model;
-						glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-						draw3DObject(tree1);
-						smokehor = smokehor + 0.1;
-						smokever = smokever + 0.1;*/
+	bindArrayBuffer(profileBar->InstanceBuffer);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, count*sizeof(Vertex), &instances[0]);
+	queueDraw3DObjectInstanced(LAYER_HUD, profileBar, count);
+}
 
-			}
-			if(diffpig3<=5 && diffpig3>=-5 && pig3collide!=1 && pig3birdcollide == 0 && pig3collisioncomplete==0) 
-			{
-				pig3birdcollide = 1;
-				pig3collisioncomplete = 1;
-				score = score + 100;
-				//	cout << "happpening" << '\n';
-				/*	        Matrices.model = glm::mat4(1.0f);
-						glm::mat4 translatetrees = glm::translate (glm::vec3(inipig6hor, inipig6ver, 0));
-						glm :: mat4 scaletrees = glm::scale (glm::vec3(0.2,0.2,1));     // glTranslatef
-						Matrices.model *= translatetrees * scaletrees; 
-						MVP = VP * Matrices.model;
-						glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-						draw3DObject(tree1);
-						smokehor = smokehor + 0.1;
-						smokever = smokever + 0.1;*/
+bool writeProfileCsv (const char* path)
+{
+	ofstream file(path);
+	if(!file.is_open()) {
+		cerr << "Could not write profile " << path << endl;
+		return false;
+	}
+	file << "frame";
+	for(int i=0;i<PHASE_COUNT;i++)
+		file << ',' << phaseNames[i] << "_ms";
+	file << ",gpu_ms\n";
+	for(size_t f=0;f<profiler.Frames.size();f++)
+	{
+		file << f;
+		for(int i=0;i<PHASE_COUNT;i++)
+			file << ',' << profiler.Frames[f].Phase[i];
+		file << ',';
+		if(profiler.Frames[f].Gpu >= 0)
+			file << profiler.Frames[f].Gpu;
+		file << '\n';
+	}
+	return true;
+}
 
-			}
-			else if(diffpig2<=5 && diffpig2>=0 && pig2collide==0) 
-			{		pig2collide = 1;score = score + 100;}
-
-			else if(diffpig4<=5 && diffpig2>=0 && pig4collide==0) 
-			{	pig4collide = 1;score = score + 100;}
-			else if(diffpig5<=5 && diffpig5>=0 && pig5birdcollide==0 && pig5collisioncomplete==0) 
-			{	pig5birdcollide = 1;score = score + 100;
-				pig5collisioncomplete = 1;}
-			else if(pig3collide == 1 && pig3collisioncomplete==0)
-			{
-				iniblock9 -= (u * cos(DEG2RAD(teta)) * (0.05));
-				block9_rotate -= 3;
-				if(/*xpig3 - iniblock9 - 55 <= 5 && xpig3 - iniblock9 - 55 >= -5 && */block9_rotate == -78)
-				{	
-					pig3collisioncomplete = 1;
-					pig3collide = 0;
-					pig3flag = 1;
-					score = score + 100;
-					//		cout << pig3flag << '\n';
-				}
-				//cout << "block9rotate" << block9_rotate << '\n';
-			}	
-			else if(pig5collide == 1 && pig5collisioncomplete==0)
-			{
-				iniblock10 -= (u * cos(DEG2RAD(teta)) * (0.05));
-				block10_rotate -= 3;
-				if(/*xpig3 - iniblock9 - 55 <= 5 && xpig3 - iniblock9 - 55 >= -5 && */block10_rotate == -78)
-				{	
-					pig5collisioncomplete = 1;
-					pig5collide = 0;
-					pig5flag = 1;
-					score = score + 100;
-					//		cout << pig3flag << '\n';
-				}
-				//	cout << "block9rotate" << block9_rotate << '\n';
-			}	
-			else
-			{
-				if(vertblock + 260 < 5 && vertblock+260 >= -5){
-					if(times == 0){
-						x = horblock;	
-						y = -260;
-						z = 0;			
-						t = 0.1;
-						starttime = glfwGetTime();
-					}
-					times = 1;
-					z = 0;
-					if( teta >=90)
-					{
-						horiu = u * cos(DEG2RAD(teta))*e + (0.6 * 9.8 * t);
-						r = u * t * cos(DEG2RAD(teta))*e + (4.9 * t * t * 0.6);
-					}
-					else if(teta < 90)
-					{
-						horiu = u * cos(DEG2RAD(teta)) - (0.6 * 9.8 * t);
-						r = u * t * cos(DEG2RAD(teta)) - (4.9 * t * t * 0.6);
-					}
-					if( x+r <= -860 || (horiu <= 1 && horiu >= -1))	
-						speednotsuff = 1;
-					//		cout << "horiu" << horiu << '\n';
-					//		cout << "x+r" << x + r << '\n';
-					//		cout << "speednotsufF" << speednotsuff << '\n';
-				}
-				//cout << "vertblock =" << vertblock << '\n';
-				//	cout << "horblock =" << horblock << '\n';
-				//cout << "u=" << u << '\n';*/
-				if(pig7disappear!=1)
-				{
-					if(((vertblock+130) <= 10 && (vertblock+130)>= -10 ) && (horblock <=360  && horblock >=260) && checkonce7hor==0 && (u*cos(DEG2RAD(teta))>= 30 ))
-					{
-						//cout << "rebounding" ;
-						///times = 0;
-						score = score + 100;
-						pig7collide = 1;
-						z = 0;
-						r = 0;
-						y = y-5;
-						x = horblock;
-						t = 0.1;
-						starttime = glfwGetTime();
-						/*checkonce7 = 1;
-						  teta = 180;
-						  y = vertblock;
-						  z = 0;
-						  t = 0.1;
-						  x = 110;
-						  r = 0;*/
-					}
-				}
-					if(((vertblock - 40) <= 5 && (vertblock - 40)>=  -4 ) && (horblock <= 900  && horblock >= 300) && checkonce4hor2==0 && (u*cos(DEG2RAD(teta))>= 30 ) )
-					{
-
-
-						x = horblock;
-						r = 0;
-						e = 0.5;
-						z = 0;
-						y = vertblock;
-						t = 0.1;
-						starttime = glfwGetTime();
-						checkonce4hor2 = 1;
-
-					}
-					if(((vertblock - (iniblock11ver+30)) <= 5 && (vertblock - (iniblock11ver+30))>=  -5 ) && (horblock <= iniblock11+350  && horblock >= iniblock11) && checkonce4hor3==0 && (u*cos(DEG2RAD(teta))>= 30) )
-					{
-						x = horblock;
-						r = 0;
-						e = 0.5;
-						z = 0;
-						y = vertblock;
-						t = 0.1;
-						starttime = glfwGetTime();
-						checkonce4hor3 = 1;
-					}
-					if(((vertblock - (iniblock11ver)) <= 5 && (vertblock - (iniblock11ver))>=  -4 ) && (horblock <= iniblock11+350  && horblock >= iniblock11) && checkonce4hor4==0 && (u*cos(DEG2RAD(teta))>= 30))
-					{
-						x = horblock;
-						r = 0;
-						e = 0.5;
-						z = 0;
-						y = vertblock;
-						teta = -teta;
-						t = 0.1;
-						starttime = glfwGetTime();
-						checkonce4hor4 = 1;
-
-					}
-					if(((vertblock+130) <= 10 && (vertblock+130)>= -10 ) && (horblock <260  && horblock >=150) && checkonce7hor2==0 && (u*cos(DEG2RAD(teta))>= 30 ) )
-					{
-						x = horblock;
-						r = 0;
-						e = 0.5;
-						z = 0;
-						y = vertblock;
-						t = 0.1;
-						starttime = glfwGetTime();
-						checkonce7hor2 = 1;
-						//cout << "rebounding" ;
-						///times = 0;
-						/*pig7collide = 1;
-						  z = 0;
-						  r = 0;
-						  y = y-5;
-						  x = horblock;
-						/*checkonce7 = 1;
-						teta = 180;
-						y = vertblock;
-						z = 0;
-						t = 0.1;
-						x = 110;
-						r = 0;*/
-
-					}
-				
-				float diffblock7 = sqrt(pow((horblock - 110),2) + pow((vertblock + 170),2)) - 40;
-				if(((horblock-110) <= 10 && (horblock-110)>= -10 ) && (vertblock <= -170 && vertblock >=-200) && checkonce7==0 && (u*cos(DEG2RAD(teta))>= 30 ) || (diffblock7 <= 5 && diffblock7 >= -5 && checkonce7 == 0))
-				{
-					//	cout << "rebounding777" ;
-					times = 0;
-					checkonce7 = 1;
-					teta = 180;
-					y = vertblock;
-					z = 0;
-					t = 0.1;
-					starttime = glfwGetTime();
-					x = 110;
-					e = 0.5;
-					r = 0;
-				}
-				//	if(diffblock7 <= 5 && diffblock7 >= -5){
-
-				if(pig3flag == 0)
-				{
-					if((horblock-(iniblock9-40) <= 10) && (horblock-(iniblock9-40) >= -10) && (vertblock <= (iniblock9ver+100) && vertblock >= iniblock9ver) && checkonce9==0 && (u*cos(DEG2RAD(teta))>= 30 ) && pig3flag == 0 && block9died!=1 && pig3collisioncomplete!=1)
-					{
-						//	cout << "rebounding" ;
-						times = 0;
-						checkonce9 = 1;
-						teta = 180;
-						y = vertblock;
-						pig3collide = 1;
-						z = 0;
-						t = 0.1;
-						block9fall = 1;
-						starttime = glfwGetTime();
-						x = iniblock9;
-						e = 0.5;
-						r = 0;
-					}
-				}
+void printProfileStats ()
+{
+	if(profiler.Frame == 0)
+		return;
+	cout << "Frame phases per frame:";
+	for(int i=0;i<PHASE_COUNT;i++)
+		cout << ' ' << phaseNames[i] << '=' << profiler.Total[i]/profiler.Frame << "ms";
+	if(profiler.GpuFrames > 0)
+		cout << " gpu=" << profiler.Total[PHASE_COUNT]/profiler.GpuFrames << "ms";
+	cout << " (" << profiler.Frame << " frames)\n";
+}
 
-				if((horblock-(iniblock9-40) <= 10) && (horblock-(iniblock9-40) >= -10) && (vertblock <= (iniblock9ver+100) && vertblock >= iniblock9ver) && checkonce13==0 && (u*cos(DEG2RAD(teta))>= 30) && block9died!=1 && block9fall==0){
-					yay2 = 1;
-					checkonce13 = 1;
-					block9fall = 1;
+/* Simulation thread - ticks at simHz on its own clock and publishes a snapshot after every tick */
+atomic<bool> simRunning;
+thread simThread;
 
-				}
+/* Replays with vsync off don't wait for the clock - every pass runs a tick */
+bool simUnpaced = false;
 
+void simulationLoop ()
+{
+	TRACE_THREAD("simulation");
+	double tick_length = 1.0 / simHz;
+	double next_tick = clockTime() + tick_length;
 
-				if((horblock-(iniblock10-40) <= 10) && (horblock-(iniblock10-40) >= -10) && (vertblock <= 150 && vertblock >=0) && checkonce10==0 && (u*cos(DEG2RAD(teta))>= 30 ) && pig5flag == 0 && block10died!=1 && pig5collisioncomplete!=1)
-				{
-					//	cout << "rebounding" ;
-					times10 = 0;
-					checkonce10 = 1;
-					teta = 180;
-					y = vertblock;
-					pig5collide = 1;
-					z = 0;
-					t = 0.1;
-					starttime = glfwGetTime();
-					x = iniblock10;
-					block10fall = 1;
-					e = 0.5;
-					r = 0;
-				}
+	while(simRunning.load())
+	{
+		// Stalled for longer than a frame should take - drop the backlog instead of a burst of catch-up ticks
+		double now = clockTime();
+		if(simUnpaced || now - next_tick > MAX_FRAME_TIME)
+			next_tick = now;
 
-				if((horblock-(iniblock10-40) <= 10) && (horblock-(iniblock10-40) >= -10) && (vertblock <= 150 && vertblock >=0) && checkonce12==0 && (u*cos(DEG2RAD(teta))>= 30 ) && block10died!=1 && block10fall ==0)
-				{
-					yay = 1;
-					checkonce12 = 1;
-					block10fall = 1;
+		while(now >= next_tick)
+		{
+			ProfileScope scope(PHASE_SIM);
+			tick(next_tick);
+			writeSnapshot(next_tick);
+			publishSnapshot();
+			next_tick += tick_length;
+		}
+		if(simUnpaced)
+			continue;
 
-				}
+		double remaining = next_tick - clockTime();
+		if(remaining > 0)
+			this_thread::sleep_for(chrono::duration<double>(remaining));
+	}
+}
 
-				float diffblock4 = sqrt(pow((horblock - 260),2) + pow((vertblock - 40),2)) - 40;
-				float diffblock42 = sqrt(pow((horblock - 260),2) + pow((vertblock - 0),2)) - 40;
-				if(((horblock-260) <= 5 && (horblock-260)>= -5 ) && (vertblock <= 40 && vertblock >=0) && checkonce4==0 && (u*cos(DEG2RAD(teta))>= 30 )|| (diffblock4 <= 3 && diffblock4 >= -3 && checkonce4 == 0) || (diffblock42 <=3 && diffblock42 >= -3 && checkonce4 ==0))
-				{
-					//		cout << "rebounding";
-					times = 0;
-					checkonce4 = 1;
-					teta = 180;
-					y = vertblock;
-					z = 0;
-					t = 0.1;
-					starttime = glfwGetTime();
-					xpig5 = xpig5 - 50;
-					xpig3 = xpig3 - 50;
-					inipig4hor -= 50;
-					if(block9died!=1 && pig3flag==0)
-						iniblock9 -= 50;
-					if(block10died!=1 && pig5flag==0)
-						iniblock10 -= 50;
-					inipig2hor += 20;
-					iniblock11 += 30;
-					if(pig3flag == 1 && pig5flag == 1)
-					{
-						inipig2hor -= 20;
-						iniblock11 -= 30;
-					}
-					x = 260;
-					e = 0.5;
-					r = 0;
-				}
-				float diffblock111 = sqrt(pow((horblock - iniblock11-40),2) + pow((vertblock - (iniblock11ver+30)),2)) - 40;
-				float diffblock112 = sqrt(pow((horblock - iniblock11-40),2) + pow((vertblock - iniblock11ver),2)) - 40;
-				if(((horblock-iniblock11-40) <= 3 && (horblock-iniblock11-40)>= -3 ) && (vertblock <= (iniblock11ver+30) && vertblock >= iniblock11ver) && checkonce11==0 && (u*cos(DEG2RAD(teta))>= 30 )|| (diffblock111 <= 3 && diffblock111 >= -3 && checkonce11 == 0) || (diffblock112 <=3 && diffblock112 >= -3 && checkonce11 ==0))
-				{
-					//		cout << "rebounding" ;
-					times = 0;
-					checkonce11= 1;
-					teta = 180;
-					y = vertblock;
-					z = 0;
-					t = 0.1;
-					starttime = glfwGetTime();
-					x = 360;
-					e = 0.5;
-					r = 0;
-				}
-				if(((horblock-360) <= 10 && (horblock-360)>= -10 ) && (vertblock <= 40 && vertblock >=-300) && checkonce6==0 && (u*cos(DEG2RAD(teta))>= 30) )
-				{
-					//		cout << "rebounding" ;
-					times= 0;
-					checkonce6 = 1;
-					teta = 180;
-					y = vertblock;
-					e = 0.5;
-					z = 0;
-					t = 0.1;
-					starttime = glfwGetTime();
-					x = 360;
-					r = 0;
-				}
-				/*	else if(((horblock-360) <= 10 && (horblock-360)>= -10 ) && (vertblock <= 40 && vertblock >=-300) && checkonce6==0 && (u*cos(DEG2RAD(teta))< 30 ))
-					{		
-					times = 0;
-					checkonce6 = 1;
-					speednotsuff = 1;
-					x = 360;
-					r = 0;
-					z = 0;
-
-					}*/
-				if(((horblock-150) <= 10 && (horblock-150)>= -10 ) && (vertblock <= -200 && vertblock >=-300) && checkonce8==0 && (u*cos(DEG2RAD(teta))>= 30 ) )
-				{
-					//		cout << "rebounding" ;
-					times = 0;
-
-					e = 0.5;
-					checkonce8 = 1;
-					teta = 180;
-					t = 0.1;
-					starttime = glfwGetTime();
-					x = 150;
-					y = vertblock;
-					z = 0;
-					r = 0;
-				}
-				if(((horblock-270) <= 10 && (horblock-270)>= -10 ) && (vertblock <= -200 && vertblock >=-300) && checkonce82==0 && (u*cos(DEG2RAD(teta))>= 30 ) )
-				{
-					//		cout << "rebounding" ;
-					times = 0;
-					e = 0.5;
-					checkonce82 = 1;
-					teta = 180;
-					t = 0.1;
-					starttime = glfwGetTime();
-					x = 150;
-					y = vertblock;
-					z = 0;
-					r = 0;
-				}
-				if(((iniblock9+40) <= iniblock11 || (iniblock10+40 <= iniblock11)) && cominghere==0)
-				{
-					cominghere=0;
-					pig5collisioncomplete = 1;
-					basegone = 1;
-				}
-				/*else if(((horblock-150) <= 10 && (horblock-150)>= -10 ) && (vertblock <= -200 && vertblock >=-300) && checkonce8==0 && (u*cos(DEG2RAD(teta))< 30 ))
-				  {		
-				  times = 0;
-				  checkonce8 = 1;
-				  speednotsuff = 1;
-				  x = 150;
-				  r = 0;
-				  z = 0;
+void startSimulation ()
+{
+	snapshots.Back = 0;
+	snapshots.Middle.store(1);
+	snapshots.Front = 2;
 
-				  }*/
+	// Something to draw before the first tick
+	writeSnapshot(clockTime());
+	publishSnapshot();
 
-			}
-			}	
-			//cout << "q=" << q << '\n';
-			//cout << basegone << endl; 
-			if(((pig3flag == 1 && pig5flag == 1) || (basegone==1)) && yes == 0)
-			{	
-				if(timescheck == 0){
-					if(basegone == 1)
-						score = score+100;
-					tlast = 0;
-				}
-				timescheck = 1;
-				tlast += 0.1;
-				inipig2ver -= 4.9*tlast*tlast;
-				iniblock11ver -= 4.9*tlast*tlast;
-				flaggyfally = 1;
-				if(basegone == 1)
-				{
-
-					if(iniblock11ver-inipig5ver <=5 && iniblock11ver-inipig5ver >= -5)
-						pig5flag2 = 1;}
-				if(iniblock11ver-40 <=5){
-					flaggyfally = 0;
-					yes = 1;
-				}
-			}
+	simRunning.store(true);
+	simThread = thread(simulationLoop);
+}
 
-			if((q > 2600 || vertblock < -1560 or speednotsuff==1) and pig6collide==0 and pig2collide == 0 and pig4collide == 0 && pig7collide == 0 && pig3collide == 0 && block9finish == 0 && block10finish == 0 && pig3birdcollide==0 && pig5collide==0 && pig5birdcollide == 0 && flaggyfally == 0 && yay == 0 && yay2 == 0) {
-				//		cout << "entering" << '\n';
-				//lifeflag = 1;
-				lifes = lifes+1;
-				flag = 0;
-				usleep(500000);
-				teta = tetacannon;
-				speednotsuff = 0;
-				pig5collide = 0;
-				checkonce4 = 0;
-				checkonce6 = 0;
-				checkonce7 = 0;
-				checkonce7hor = 0;
-				checkonce8 = 0;
-				checkonce9 = 0;
-				checkonce11 = 0;
-				u = prevu;
-				ang = 0;
-				smokehor = 0.5;
-				smokever = 0.5;
-				times2 = 0;
-				checkonce82 = 0;
-				checkonce7hor2 = 0;
-				checkonce4hor2 = 0;
-				times = 0;
-				smokex = -670;
-				smokey = 275;
-				pig7collide = 0;
-				pig6collide = 0;
-				pig2collide = 0;
-				e = 1;
-				pig4collide = 0;
-				count = 0;
-				block10collide =0;
-				r = 0;
-				z = 0;
-				t = 0;
-				starttime = glfwGetTime();
-				/*if(tetacannon == 0){
-				  x = x-2;
-				  y = -133.f;}
-				  else*/
-
-				x = -840.0f + 200 * cos(DEG2RAD(tetacannon));//*(0.5) + (250 * cos(DEG2RAD(teta)) * (0.5)); 
-				y = -140.f + 220 * sin(DEG2RAD(tetacannon));
-				if(tetacannon < 0)
-					y = -140.f + 180 * sin(DEG2RAD(tetacannon));//* (0.8) + (220 * sin(DEG2RAD(teta)) * (0.4));
-				else if(tetacannon >= 0 && tetacannon <= 10)
-					y = -140.f + 280 * sin(DEG2RAD(tetacannon));
+void stopSimulation ()
+{
+	simRunning.store(false);
+	if(simThread.joinable())
+		simThread.join();
+}
 
-			}
+/* Render the scene with openGL - from the newest snapshot, between its two ticks */
+/* Edit this function according to your assignment */
+void draw ()
+{
+	TRACE_SCOPE("draw");
+	const Snapshot &snapshot = latestSnapshot();
+	float alpha = min(max((float)((clockTime() - snapshot.Time) * simHz), 0.0f), 1.0f);
 
-			// Load identity to model matrix
+	drawnTick = snapshot.Tick;
+	if(replaying)
+		replayCamera(snapshot.Tick);
 
+	Matrices.projection = glm::ortho(lefthor, righthor, vertdown, vertup, 0.1f, 500.0f);
+	// clear the color and depth in the frame buffer
+	glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-			/* Render your scene */
+	// use the loaded shader program
+	// Don't change unless you know what you are doing
+	useShader (FLAT_SHADER);
 
-			// rotate about vector (1,0,0)
-		}
-		//projectile
-		//Increment angles
-		/* float increments = 1;
-		   triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;*/
-
-		//  triangle_rotation = triangle_rotation + increments*triangle_rot_dir*triangle_rot_status;
-		//rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
-
-		//  draws the VAO given to it using current MVP matrix
-		//  draw3DObject(triangle);
-		// Pop matrix to undo transformations till last push matrix instead of recomputing model matrix
-		// glPopMatrix ();
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-		glm::mat4 translateRectangle = glm::translate (glm::vec3(-840,-140,0));        // glTranslatef
-		// rotate about vector (-1,1,1)
-		Matrices.model *= translateRectangle * rotateRectangle;
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		// draw3DObject draws the VAO given to it using current MVP matrix
-		draw3DObject(rectangle);
-		/* Matrices.model = glm::mat4(1.0f);
-		   glm::mat4 translatebase = glm::translate (glm::vec3(-430,-430,0));        // glTranslatef
-		// rotate about vector (-1,1,1)
-		Matrices.model *= translatebase;
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		// draw3DObject draws the VAO given to it using current MVP matrix
-		draw3DObject(base); */
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translatecircle = glm::translate (glm::vec3(x + r, y + z ,0.0f)); 
-
-		glm::mat4 circleTransform = translatecircle; //* rotatecircle;
-
-		Matrices.model *= circleTransform; 
-		MVP = VP * Matrices.model; // MVP = p * V * M
+	// Eye - Location of camera. Don't change unless you are sure!!
+	glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 0, 5*sin(camera_rotation_angle*M_PI/180.0f) );
+	// Target - Where is the camera looking at.  Don't change unless you are sure!!
+	glm::vec3 target (0, 0, 0);
+	// Up - Up vector defines tilt of camera.  Don't change unless you are sure!!
+	glm::vec3 up (0, 1, 0);
 
-		//  Don't change unless you are sure!!
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(circle); 
+	// Compute Camera matrix (view)
+	// Matrices.view = glm::lookAt( eye, target, up ); // Rotating Camera for 3D
+	//  Don't change unless you are sure!!
+	Matrices.view = glm::lookAt(glm::vec3(0,0,3), glm::vec3(0,0,0), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
 
-		Matrices.model = glm::mat4(1.0f);
-		glm::mat4 translatetrees = glm::translate (glm::vec3(smokex, smokey, 0));
-		glm :: mat4 scaletrees = glm::scale (glm::vec3(smokehor,smokever,1));     // glTranslatef
-		Matrices.model *= translatetrees * scaletrees; 
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-		draw3DObject(tree1);
+	// Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
+	//  Don't change unless you are sure!!
+	glm::mat4 VP = Matrices.projection * Matrices.view;
 
-		Matrices.model = glm::mat4(1.0f);
+	// Send our camera to the shaders through the Camera uniform block
+	// The M part of MVP is looked up per draw in the model buffer
+	//  Don't change unless you are sure!!
+	updateCameraBuffer(VP);
+
+	// Static scenery - already in world space (draw id 0), one draw per shader.
+	// Queued back to front; flushDrawQueue() reorders for the depth test
+	queueDraw3DObject(LAYER_BACKGROUND, backgroundBatch);
+	queueDraw3DObject(LAYER_BACKGROUND, backgroundEllipseBatch);
+	queueDraw3DObject(LAYER_SCENERY, staticBatch);
+	queueDraw3DObject(LAYER_SCENERY, staticEllipseBatch);
+
+	// Place every object between its last two ticks, then draw the table in order
+	interpolateEntities(snapshot.Previous, snapshot.Current, alpha);
+	updateModelBuffer();
+
+	// Moving objects are submitted to the sprite batch and drawn together once the scene is done
+	spriteBatch.begin();
+	for(int i=0;i<(int)entities.size();i++)
+	{
+		Entity &entity = entities[i];
+		if(!entity.Visible)
+			continue;
 
-		//glm::mat4 rotatee = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-		glm::mat4 translatetrees6 = glm::translate (glm::vec3(-670, 275, 0));        // glTranslatef
-		// rotate about vector (-1,1,1)
-		Matrices.model *= translatetrees6; //* rotateRectangle;
-		MVP = VP * Matrices.model;
-		glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
+		if(entity.Streamed && spriteBatch.submit(entity.Mesh, glm::vec2(entity.X, entity.Y), entity.Rotation, glm::vec2(entity.ScaleX, entity.ScaleY)))
+			continue;
 
-		// draw3DObject draws the VAO given to it using current MVP matrix
-		draw3DObject(tree6);
+		//  Don't change unless you are sure!!
+		queueDraw3DObject(LAYER_OBJECTS, entity.Mesh, i+1);
+	}
+	spriteBatch.flush(LAYER_OBJECTS);
 
-		if(pig3flag == 0){
-			Matrices.model = glm::mat4(1.0f);
-			// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-			glm::mat4 translatepig3 = glm::translate (glm::vec3(xpig3, inipig3ver, 0.0f)); // glTranslatef
+	// HUD - offsets are baked into the instance buffers, so the model matrix is identity
 
+	// Remaining lives
+	queueDraw3DObjectInstanced(LAYER_HUD, lifecircle, 10-snapshot.Lifes);
 
-			glm::mat4 Transformpig3 = translatepig3; //* rotateblock2;
+	// Power meter - one bar per unit of u
+	if(snapshot.Flag == 0)
+		queueDraw3DObjectInstanced(LAYER_HUD, speedrect, (int)ceil(snapshot.Power));
 
-			Matrices.model *= Transformpig3; 
-			MVP = VP * Matrices.model; // MVP = p * V * M
+	// Frame profiler, P toggles it
+	if(profilerVisible)
+		updateProfileBar();
 
-			//  Don't change unless you are sure!!
-			glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-			//camera_rotation_angle++; // Simulating camera rotation
-			draw3DObject(pig3);} 
+	flushDrawQueue();
+}
 
-		if(pig5flag==0 && pig5flag2 ==0)
-		{
-			Matrices.model = glm::mat4(1.0f);
-			// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
 
-			glm::mat4 translatepig5 = glm::translate (glm::vec3(xpig5,inipig5ver, 0.0f)); // glTranslatef
-			glm::mat4 Transformpig5 = translatepig5; //* rotateblock2;
 
-			Matrices.model *= Transformpig5; 
-			MVP = VP * Matrices.model; // MVP = p * V * M
+	/* Initialise glfw window, I/O callbacks and the renderer to use */
+	/* Nothing to Edit here */
+/* Frame pacing - vsync, no cap at all, or vsync off with a sleep until the next frame's deadline.
+ * Frame times go into a histogram over the last FRAME_WINDOW frames */
+enum { PACE_VSYNC, PACE_UNCAPPED, PACE_CAPPED };
+
+#define FRAME_WINDOW 4096
+#define FRAME_BUCKET 0.05 // ms per histogram bucket
+#define FRAME_BUCKETS 5000 // last bucket also holds everything slower than 250ms
+
+struct FramePacer {
+	int Mode;
+	double Cap;          // frames per second in PACE_CAPPED
+	struct timespec Deadline;
+	struct timespec LastFrame;
+
+	float Times[FRAME_WINDOW]; // ring of recent frame times, ms
+	int Buckets[FRAME_BUCKETS];
+	long Frames;
+} pacer;
+
+double elapsedMs (const struct timespec &from, const struct timespec &to)
+{
+	return (to.tv_sec - from.tv_sec)*1e3 + (to.tv_nsec - from.tv_nsec)*1e-6;
+}
 
-			//  Don't change unless you are sure!!
-			glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-			//camera_rotation_angle++; // Simulating camera rotation
-			draw3DObject(pig5);
-		} 
+int frameBucket (float ms)
+{
+	int bucket = (int)(ms / FRAME_BUCKET);
+	return min(max(bucket, 0), FRAME_BUCKETS-1);
+}
 
-		if(flag == 0)
-		{
-			for(int j=0;j<u;j=j+1)
-			{	
+/* Pick the mode from the command line - call before the window exists */
+void setFramePacing (int mode, double cap)
+{
+	pacer.Mode = mode;
+	pacer.Cap = cap;
+	pacer.Frames = 0;
+	for(int i=0;i<FRAME_BUCKETS;i++)
+		pacer.Buckets[i] = 0;
+	clock_gettime(CLOCK_MONOTONIC, &pacer.LastFrame);
+	pacer.Deadline = pacer.LastFrame;
+}
 
-				Matrices.model = glm::mat4(1.0f);
-				//glm::mat4 rotateRectangle = glm::rotate((float)(rectangle_rotation*M_PI/180.0f), glm::vec3(0,0,1)); 
-				glm::mat4 translaterect = glm::translate (glm::vec3(-950,(-200+j*2),0));        // glTranslatef
-				// rotate about vector (-1,1,1)
-				Matrices.model *= translaterect;// * rotateRectangle;
-				MVP = VP * Matrices.model;
-				glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-				// draw3DObject draws the VAO given to it using current MVP matrix
-				draw3DObject(speedrect);
-			}
+/* Call once per frame right before the swap - sleeps out the rest of the frame when capped, then records its length */
+void paceFrame ()
+{
+	struct timespec now;
+	if(pacer.Mode == PACE_CAPPED)
+	{
+		long period = (long)(1e9 / pacer.Cap);
+		pacer.Deadline.tv_nsec += period;
+		while(pacer.Deadline.tv_nsec >= 1000000000L) {
+			pacer.Deadline.tv_nsec -= 1000000000L;
+			pacer.Deadline.tv_sec++;
 		}
 
-		if(basegone == 1 && timesparks<40)
-		{
-		timesparks++;
-		Matrices.model = glm::mat4(1.0f);
-			// glm::mat4 rotateblock2 = glm::rotate((float)(270*M_PI/180.0f), glm::vec3(0,0,1)); 
-			glm::mat4 translatesparks = glm::translate (glm::vec3(650, 40, 0.0f)); // glTranslatef
-
+		// Fell more than a frame behind - start over from now rather than rushing to catch up. Less than that
+		// is made up by the next frames, so the average rate stays on the cap
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(elapsedMs(pacer.Deadline, now) > period/1e6)
+			pacer.Deadline = now;
+#ifdef __APPLE__
+		double remaining = elapsedMs(now, pacer.Deadline);
+		struct timespec wait = { 0, (long)(remaining*1e6) };
+		if(remaining > 0)
+			nanosleep(&wait, NULL);
+#else
+		while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &pacer.Deadline, NULL) == EINTR)
+			;
+#endif
+	}
 
-			glm::mat4 Transformsparks = translatesparks; //* rotateblock2;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	float ms = elapsedMs(pacer.LastFrame, now);
+	pacer.LastFrame = now;
 
-			Matrices.model *= Transformsparks; 
-			MVP = VP * Matrices.model; // MVP = p * V * M
+	int slot = pacer.Frames % FRAME_WINDOW;
+	if(pacer.Frames >= FRAME_WINDOW)
+		pacer.Buckets[frameBucket(pacer.Times[slot])]--;
+	pacer.Times[slot] = ms;
+	pacer.Buckets[frameBucket(ms)]++;
+	pacer.Frames++;
+}
 
-			//  Don't change unless you are sure!!
-			glUniformMatrix4fv(Matrices.MatrixID, 1, GL_FALSE, &MVP[0][0]);
-			//camera_rotation_angle++; // Simulating camera rotation
-			draw3DObject(sparks); 
-		}
+/* Frame time below which the given fraction of the window falls, ms */
+double framePercentile (double fraction)
+{
+	long total = min(pacer.Frames, (long)FRAME_WINDOW);
+	long seen = 0;
+	for(int i=0;i<FRAME_BUCKETS;i++)
+	{
+		seen += pacer.Buckets[i];
+		if(seen >= fraction*total)
+			return (i+1)*FRAME_BUCKET;
 	}
+	return FRAME_BUCKETS*FRAME_BUCKET;
+}
 
+void printFrameStats ()
+{
+	if(pacer.Frames == 0)
+		return;
+	const char* modes [] = { "vsync", "uncapped", "capped" };
+	cout << "FRAME mode=" << modes[pacer.Mode];
+	if(pacer.Mode == PACE_CAPPED)
+		cout << "@" << pacer.Cap;
+	cout << " p50=" << framePercentile(0.50) << "ms p95=" << framePercentile(0.95) << "ms p99=" << framePercentile(0.99) << "ms";
+	cout << " (last " << min(pacer.Frames, (long)FRAME_WINDOW) << " frames)" << '\n';
+}
 
-	/* Initialise glfw window, I/O callbacks and the renderer to use */
-	/* Nothing to Edit here */
 	GLFWwindow* initGLFW (int width, int height)
 	{
 		GLFWwindow* window; // window desciptor/handle
@@ -2444,7 +4019,7 @@ void draw ()
 
 		glfwMakeContextCurrent(window);
 		gladLoadGLLoader((GLADloadproc) glfwGetProcAddress);
-		glfwSwapInterval( 1 );
+		glfwSwapInterval( (pacer.Mode == PACE_VSYNC) ? 1 : 0 );
 
 		/* --- register callbacks with GLFW --- */
 
@@ -2473,6 +4048,7 @@ void draw ()
 	/* Add all the models to be created here */
 	void initGL (GLFWwindow* window, int width, int height)
 	{
+		TRACE_SCOPE("initGL");
 		/* Objects should be created before any other gl function and shaders */
 		// Create the models
 		createbackground();
@@ -2483,25 +4059,15 @@ void draw ()
 		createTriangle();//cannon // Generate the VAO, VBOs, vertices data & copy into the array buffer
 		rectangle = createRectangle (-30,0,190,0,220,50,-30,50,0.239,0.239,0.239); //
 		createbase();//hill
-		block1 = createblocks(0,0,40,0,40,70,0,70,0.239,0.239,0.239);//small pig standing on it
-		block2 = createblocks(0,0,0,320,-40,320,-40,40,0.239,0.239,0.239); //right trapezium 1
-		block3 = createblocks(0,0,0,240,-40,240,-40,40,0.239,0.239,0.239);//right trapezium 2
-		block4 = createblocks(0,0,600,0,600,40,0,40,0.239,0.239,0.239); //bigger horizontal
-		block5 = createblocks(0,0,0,240,-40,240,-40,-40,0.239,0.239,0.239); //left trapezium
-		block6 = createblocks(0,0,40,0,40,340,0,340,0.239,0.239,0.239); //left big bar
-		block7 = createblocks(0,0,250,0,250,30,0,30,0.239,0.239,0.239); //below horizontal
-		block8 = createblocks(0,0,40,0,40,100,0,100,0.239,0.239,0.239);//left most vertical
-		block9 = createblocks(0,0,40,0,40,120,0,120,0.239,0.239,0.239);//upward left vertical
-		block10 = createblocks(0,0,40,0,40,120,0,120,0.239,0.239,0.239); //upward right vertical
-		block11 = createblocks(0,0,350,0,350,30,0,30,0.239,0.239,0.239); //highest horizontal
+		for(int i=0;i<TOWER_BLOCKS;i++)
+		{
+			const GLfloat* o = towerBlocks[i].Outline;
+			blocks[i] = createblocks(o[0],o[1],o[2],o[3],o[4],o[5],o[6],o[7],0.239,0.239,0.239);
+		}
 		speedrect = createblocks(0,0,35,0,35,2,0,2,0,1,0);
 		//pig1 = createTrees(25,20,0,1,0);//pigs//smallest not needed
-		pig2 = createTrees(50,40,0,1,0);//highest
-		pig3 = createTrees(60,40,0,1,0);//central one above fattest hor bar
-		pig4 = createTrees(40,30,0,1,0);//left fat bar
-		pig5 = createTrees(50,35,0,1,0);//right and fat bar
-		pig6 = createTrees(70,50,0,1,0);//biggest left
-		pig7 = createTrees(50,40,0,1,0);//pig on the ground
+		for(int i=0;i<TOWER_PIGS;i++)
+			pigs[i] = createTrees(towerPigs[i].RadiusX,towerPigs[i].RadiusY,0,1,0);
 		circle = createTrees(40,40,1,0,0);//bird
 		sparks = createSparks(100,20);
 		tree1 = createTrees(50,35,0.619,0.619,0.619);//clouds
@@ -2512,10 +4078,58 @@ void draw ()
 		tree6 = createTrees(45,35,1,1,1);
 		lifecircle = createTrees(20,20,1,0,0);
 
+		// Place every object in the render table
+		createStaticEntities();
+		createEntities();
+
+		// Per instance offsets for the HUD - 200 power meter bars, 10 lives
+		GLfloat speed_instance_data [5*200];
+		for(int j=0;j<200;j++)
+		{
+			speed_instance_data [5*j] = -950;
+			speed_instance_data [5*j + 1] = -200+j*2;
+			speed_instance_data [5*j + 2] = 1;
+			speed_instance_data [5*j + 3] = 1;
+			speed_instance_data [5*j + 4] = 1;
+		}
+		createInstanceBuffer(speedrect, 200, speed_instance_data);
+
+		GLfloat lifes_instance_data [5*10];
+		for(int i=0;i<10;i++)
+		{
+			lifes_instance_data [5*i] = 900-(i*50);
+			lifes_instance_data [5*i + 1] = 450;
+			lifes_instance_data [5*i + 2] = 1;
+			lifes_instance_data [5*i + 3] = 1;
+			lifes_instance_data [5*i + 4] = 1;
+		}
+		createInstanceBuffer(lifecircle, 10, lifes_instance_data);
+
 		// Create and compile our GLSL program from the shaders
 		programID = LoadShaders( "Sample_GL.vert", "Sample_GL.frag" );
-		// Get a handle for our "MVP" uniform
-		Matrices.MatrixID = glGetUniformLocation(programID, "MVP");
+		// Ellipses (pigs, clouds, bird, wheel) are one quad each, shaded by distance to the edge
+		ellipseProgramID = LoadShaders( "Sample_GL_Ellipse.vert", "Sample_GL_Ellipse.frag" );
+
+		// Get a handle for our "ModelIndex" uniform, and point both programs at the
+		// Camera block (binding 0) and the model texture buffer (unit 0)
+		Matrices.ModelIndexID = glGetUniformLocation(programID, "ModelIndex");
+		Matrices.EllipseModelIndexID = glGetUniformLocation(ellipseProgramID, "ModelIndex");
+		Matrices.DepthID = glGetUniformLocation(programID, "Depth");
+		Matrices.EllipseDepthID = glGetUniformLocation(ellipseProgramID, "Depth");
+		GLuint programs [] = { programID, ellipseProgramID };
+		for(int i=0;i<2;i++)
+		{
+			glUniformBlockBinding(programs[i], glGetUniformBlockIndex(programs[i], "Camera"), 0);
+			bindProgram(programs[i]);
+			glUniform1i(glGetUniformLocation(programs[i], "Models"), 0);
+		}
+		createTransformBuffers();
+		createStreamBuffer(64*1024);
+		createProfiler();
+		updateModelBuffer();
+		// Objects drawn without an instance buffer get no offset and no tint
+		glVertexAttrib2f(2, 0, 0);
+		glVertexAttrib4f(3, 1, 1, 1, 1);
 
 
 		reshapeWindow (window, width, height);
@@ -2527,35 +4141,481 @@ void draw ()
 		glEnable (GL_DEPTH_TEST);
 		glDepthFunc (GL_LEQUAL);
 
+		// Ellipse edges are anti-aliased through alpha
+		glEnable (GL_BLEND);
+		glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
 		cout << "VENDOR: " << glGetString(GL_VENDOR) << endl;
 		cout << "RENDERER: " << glGetString(GL_RENDERER) << endl;
 		cout << "VERSION: " << glGetString(GL_VERSION) << endl;
 		cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 	}
 
+/* Input scripts - "<tick> <key>" per line, keys by their keyNames, # starts a comment */
+int keyByName (const char* name)
+{
+	for(int key=0;key<KEY_COUNT;key++)
+		if(strcmp(keyNames[key], name) == 0)
+			return key;
+	return -1;
+}
+
+bool loadInputScript (const char* path, vector<RecordedInput> &inputs)
+{
+	ifstream file(path);
+	if(!file.is_open()) {
+		cerr << "Could not open input script " << path << endl;
+		return false;
+	}
+
+	string line;
+	while(getline(file, line))
+	{
+		line = line.substr(0, line.find('#'));
+		char name[16];
+		long tick;
+		if(sscanf(line.c_str(), "%ld %15s", &tick, name) != 2)
+			continue;
+		int key = keyByName(name);
+		if(key < 0) {
+			cerr << "Ignoring unknown key " << name << " in " << path << endl;
+			continue;
+		}
+		RecordedInput input = { tick, key };
+		inputs.push_back(input);
+	}
+	return true;
+}
+
+/* Recordings - "ABRP", then simHz and the number of inputs, then one varint per input holding
+ * the ticks since the previous input shifted left by 4 with the key in the low bits */
+#define RECORDING_MAGIC "ABRP"
+
+void writeVarint (ofstream &file, unsigned long value)
+{
+	while(value >= 0x80) {
+		file.put((char)(value | 0x80));
+		value >>= 7;
+	}
+	file.put((char)value);
+}
+
+bool readVarint (ifstream &file, unsigned long &value)
+{
+	value = 0;
+	for(int shift=0;shift<64;shift+=7)
+	{
+		int byte = file.get();
+		if(byte == EOF)
+			return false;
+		value |= (unsigned long)(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+/* Merge what both threads recorded into one tick ordered list and write it out */
+bool saveRecording (const char* path)
+{
+	ofstream file(path, ios::binary);
+	if(!file.is_open()) {
+		cerr << "Could not write recording " << path << endl;
+		return false;
+	}
+
+	vector<RecordedInput> inputs;
+	size_t game = 0, camera = 0;
+	while(game < recordedInputs.size() || camera < recordedCamera.size())
+	{
+		if(camera == recordedCamera.size() || (game < recordedInputs.size() && recordedInputs[game].Tick <= recordedCamera[camera].Tick))
+			inputs.push_back(recordedInputs[game++]);
+		else
+			inputs.push_back(recordedCamera[camera++]);
+	}
+
+	file.write(RECORDING_MAGIC, 4);
+	writeVarint(file, simHz);
+	writeVarint(file, inputs.size());
+	long previous = 0;
+	for(size_t i=0;i<inputs.size();i++)
+	{
+		writeVarint(file, (unsigned long)(inputs[i].Tick - previous) << 4 | inputs[i].Key);
+		previous = inputs[i].Tick;
+	}
+	cout << "Recorded " << inputs.size() << " inputs over " << previous << " ticks to " << path << '\n';
+	return true;
+}
+
+/* Read a recording - it also sets simHz, a replay only comes out the same at the rate it was recorded at */
+bool loadRecording (const char* path, vector<RecordedInput> &inputs)
+{
+	ifstream file(path, ios::binary);
+	char magic[4];
+	if(!file.is_open() || !file.read(magic, 4) || memcmp(magic, RECORDING_MAGIC, 4) != 0) {
+		cerr << "Not a recording: " << path << endl;
+		return false;
+	}
+
+	unsigned long hz, size, value;
+	if(!readVarint(file, hz) || !readVarint(file, size) || hz == 0) {
+		cerr << "Truncated recording " << path << endl;
+		return false;
+	}
+	simHz = hz;
+
+	long tick = 0;
+	for(unsigned long i=0;i<size;i++)
+	{
+		if(!readVarint(file, value) || (value & 15) >= KEY_COUNT) {
+			cerr << "Truncated recording " << path << endl;
+			return false;
+		}
+		tick += value >> 4;
+		RecordedInput input = { tick, (int)(value & 15) };
+		inputs.push_back(input);
+	}
+	return true;
+}
+
+/* Headless runs - the game without a window or a GL context, driven by a replay or an input script */
+/* --max-ticks : a headless run still going after this many ticks gives up, 0 is HEADLESS_MAX_TIME seconds of them */
+long maxTicks = 0;
+#define HEADLESS_MAX_TIME 600
+
+/* Tick as fast as the CPU allows until the game is decided, or the script has run out and
+ * nothing is moving any more - a --stress run always lasts at least STRESS_RUN_TIME.
+ * Returns false if it hit the tick cap instead, something never came to rest */
+bool runHeadless ()
+{
+	createEntities();
+	long minTicks = stressBlocks > 0 ? (long)STRESS_RUN_TIME*simHz : 0;
+	long limit = maxTicks > 0 ? maxTicks : (long)HEADLESS_MAX_TIME*simHz;
+	bool finished = true;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while(true)
+	{
+		tick(simTick / (double)simHz);
+
+		if(flag == 0 && (score == 600 || lifes >= 10))
+			break;
+		if(replayFinished() && simTick >= minTicks)
+			break;
+		if(simTick >= limit)
+		{
+			finished = false;
+			break;
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = elapsedMs(start, end) / 1000;
+	cout << "Headless: ticks=" << simTick << " shots=" << shotsFired << " in " << seconds*1000 << "ms";
+	cout << " ticks/s=" << simTick/seconds << " shots/s=" << shotsFired/seconds << '\n';
+	return finished;
+}
+
+/* --check-tower : the level left alone for this many seconds of ticks, every body awake the whole time, must not lose
+ * a pig - a tower that only stands while it sleeps comes down on its own at the first touch */
+float checkTowerTime = 0;
+
+int countPigs ()
+{
+	int pigs = 0;
+	for(int i=0;i<(int)bodies.size();i++)
+		if(bodies[i].Kind == BODY_PIG && bodies[i].Enabled)
+			pigs++;
+	return pigs;
+}
+
+bool checkTower ()
+{
+	createEntities();
+	int pigs = countPigs();
+	long ticks = lround(checkTowerTime*simHz);
+	while(simTick < ticks)
+	{
+		for(int i=0;i<(int)bodies.size();i++)
+			if(bodies[i].Enabled && bodies[i].InvMass > 0 && !bodies[i].Awake)
+				setBodyAwake(i, true);
+		tick(simTick / (double)simHz);
+		if(countPigs() < pigs)
+			break;
+	}
+
+	bool standing = countPigs() == pigs;
+	cout << "Tower check: pigs=" << countPigs() << "/" << pigs << " after " << simTick << " of " << ticks << " ticks";
+	cout << (standing ? " STANDING" : " FELL") << '\n';
+	return standing;
+}
+
+#ifdef BENCH_RENDER
+/* Render benchmark - the level drawn into an FBO on a surfaceless EGL context, so it runs on
+ * Mesa llvmpipe without a display or a GPU. Goes through the same initGL() and draw() as the game */
+#define BENCH_QUERIES 4 // GL_TIME_ELAPSED results are read this many frames late, so reading never stalls
+#define BENCH_WARMUP 10 // first frames pay for driver side setup and are left out of the numbers
+
+bool createBenchContext (int width, int height)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+	EGLDisplay display = EGL_NO_DISPLAY;
+	if(getPlatformDisplay != NULL)
+		display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if(display == EGL_NO_DISPLAY)
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	EGLint major, minor;
+	if(display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor) || !eglBindAPI(EGL_OPENGL_API)) {
+		cerr << "Failed to initialize EGL" << endl;
+		return false;
+	}
+
+	const EGLint attributes [] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, attributes);
+	if(context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+		cerr << "Failed to create a surfaceless OpenGL 3.3 context" << endl;
+		return false;
+	}
+	gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+	// There is no default framebuffer - everything is drawn into this one
+	GLuint framebuffer, renderbuffers[2];
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glGenRenderbuffers(2, renderbuffers);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+	if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+		cerr << "Benchmark framebuffer is incomplete" << endl;
+		return false;
+	}
+	return true;
+}
+
+void printBenchTimes (const char* name, vector<double> times)
+{
+	if(times.empty())
+		return;
+	sort(times.begin(), times.end());
+	double sum = 0;
+	for(size_t i=0;i<times.size();i++)
+		sum += times[i];
+	cout << name << " mean=" << sum/times.size() << "ms p95=" << times[(size_t)(times.size()*0.95)];
+	cout << "ms p99=" << times[(size_t)(times.size()*0.99)] << "ms\n";
+}
+
+/* Draw warm up and measured frames of the level, one simulation tick each on this thread, so every run draws the same frames.
+ * Submit is the CPU time of draw(), flush the stream and state bookkeeping and glFlush after it,
+ * GPU time comes from a GL_TIME_ELAPSED query around the whole frame */
+int benchRender (int frames)
+{
+	if(!createBenchContext(width, height))
+		return EXIT_FAILURE;
+	initGL(NULL, width, height);
+
+	snapshots.Back = 0;
+	snapshots.Middle.store(1);
+	snapshots.Front = 2;
+
+	GLuint queries[BENCH_QUERIES];
+	glGenQueries(BENCH_QUERIES, queries);
+	vector<double> submit, flush, gpu;
+
+	frames += BENCH_WARMUP;
+	for(int frame=0;frame<frames+BENCH_QUERIES-1;frame++)
+	{
+		if(frame < frames)
+		{
+			// Stamped a tick ago, so draw() shows the tick that just ran
+			tick(clockTime());
+			writeSnapshot(clockTime() - 1.0/simHz);
+			publishSnapshot();
+
+			// Submission and flush are timed apart - llvmpipe rasterizes the frame in glFlush,
+			// which would bury what draw() itself costs
+			struct timespec start, submitted, end;
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			glBeginQuery(GL_TIME_ELAPSED, queries[frame % BENCH_QUERIES]);
+			draw();
+			clock_gettime(CLOCK_MONOTONIC, &submitted);
+			endStreamFrame();
+			endStateFrame();
+			glEndQuery(GL_TIME_ELAPSED);
+			glFlush();
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			if(frame >= BENCH_WARMUP)
+			{
+				submit.push_back(elapsedMs(start, submitted));
+				flush.push_back(elapsedMs(submitted, end));
+			}
+		}
+
+		int done = frame - (BENCH_QUERIES-1);
+		if(done >= BENCH_WARMUP)
+		{
+			GLuint64 elapsed;
+			glGetQueryObjectui64v(queries[done % BENCH_QUERIES], GL_QUERY_RESULT, &elapsed);
+			gpu.push_back(elapsed / 1e6);
+		}
+	}
+
+	cout << "BENCH frames=" << submit.size() << " ticks=" << simTick << " score=" << score << '\n';
+	printBenchTimes("BENCH submit", submit);
+	printBenchTimes("BENCH flush", flush);
+	printBenchTimes("BENCH gpu", gpu);
+	printStateStats();
+	printStreamStats();
+	printSpriteStats();
+	printFillStats();
+	return EXIT_SUCCESS;
+}
+#endif
+
 	int main (int argc, char** argv)
 	{
 
 
+		int pacing = PACE_VSYNC;
+		double fps_cap = 0;
+		bool headless = false;
+		const char* script_path = NULL;
+		const char* record_path = NULL;
+		const char* replay_path = NULL;
+		const char* profile_path = NULL;
+		const char* trace_path = "trace.json";
+#ifdef BENCH_RENDER
+		int bench_frames = 1000;
+#endif
+		for(int i=1;i<argc;i++)
+		{
+			if(strcmp(argv[i], "--headless") == 0)
+				headless = true;
+			else if(strcmp(argv[i], "--script") == 0 && i+1 < argc)
+				script_path = argv[++i];
+			else if(strcmp(argv[i], "--record") == 0 && i+1 < argc)
+				record_path = argv[++i];
+			else if(strcmp(argv[i], "--replay") == 0 && i+1 < argc)
+				replay_path = argv[++i];
+			else if(strcmp(argv[i], "--profile") == 0 && i+1 < argc)
+				profile_path = argv[++i];
+			else if(strcmp(argv[i], "--trace") == 0 && i+1 < argc)
+				trace_path = argv[++i];
+#ifdef BENCH_RENDER
+			else if(strcmp(argv[i], "--frames") == 0 && i+1 < argc)
+				bench_frames = max(atoi(argv[++i]), 1);
+#endif
+			else if(strcmp(argv[i], "--sim-hz") == 0 && i+1 < argc)
+				simHz = atoi(argv[++i]);
+			else if(strcmp(argv[i], "--check-tower") == 0 && i+1 < argc)
+				checkTowerTime = max(atof(argv[++i]), 0.0);
+			else if(strcmp(argv[i], "--max-ticks") == 0 && i+1 < argc)
+				maxTicks = max(atol(argv[++i]), 0L);
+			else if(strcmp(argv[i], "--stress") == 0 && i+1 < argc)
+				stressBlocks = max(atoi(argv[++i]), 0);
+			else if(strcmp(argv[i], "--vsync") == 0 && i+1 < argc)
+				pacing = (strcmp(argv[++i], "off") == 0) ? PACE_UNCAPPED : PACE_VSYNC;
+			else if(strcmp(argv[i], "--fps-cap") == 0 && i+1 < argc)
+				fps_cap = atof(argv[++i]);
+		}
+		if(simHz < MIN_SIM_HZ || simHz > MAX_SIM_HZ)
+		{
+			cerr << "--sim-hz must be between " << MIN_SIM_HZ << " and " << MAX_SIM_HZ << endl;
+			return EXIT_FAILURE;
+		}
+		if(fps_cap > 0)
+			pacing = PACE_CAPPED; // the cap replaces vsync
+		setFramePacing(pacing, fps_cap);
+
+		if(replay_path != NULL && !loadRecording(replay_path, replayInputs))
+			return EXIT_FAILURE;
+		if(script_path != NULL && !loadInputScript(script_path, replayInputs))
+			return EXIT_FAILURE;
+		// Headless runs only ever take their input from the replay, even an empty one
+		replaying = headless || replay_path != NULL || script_path != NULL;
+		recording = record_path != NULL;
+		profiler.Logging = profile_path != NULL;
+		TRACE_OUTPUT(trace_path);
+		TRACE_THREAD("main");
+		simUnpaced = replaying && pacing == PACE_UNCAPPED;
+
+#ifdef BENCH_RENDER
+		return benchRender(bench_frames);
+#endif
+
+		if(headless && checkTowerTime > 0)
+			return checkTower() ? EXIT_SUCCESS : EXIT_FAILURE;
+		if(headless)
+		{
+			bool finished = runHeadless();
+			printInputStats();
+			printBroadphaseStats();
+			printSleepStats();
+			if(recording)
+				saveRecording(record_path);
+			cout << "SCORE=" << score << '\n';
+			cout << ((score == 600) ? "YOU WON" : (lifes >= 10) ? "YOU LOST" : "UNDECIDED") << '\n';
+			if(!finished)
+			{
+				cerr << "Headless run stopped at the tick cap of " << simTick << " ticks without finishing" << endl;
+				return EXIT_FAILURE;
+			}
+			return EXIT_SUCCESS;
+		}
+
 		GLFWwindow* window = initGLFW(width, height);
 
 		initGL (window, width, height);
 
 		double last_update_time = glfwGetTime(), current_time;
 
+		// The game runs on its own thread from here on, this one only draws
+		startSimulation();
+
 		/* Drawn loop */
 		while (!glfwWindowShouldClose(window)) {
 
-
-
 			// OpenGL Draw commands
-			draw();
+			{
+				ProfileScope scope(PHASE_DRAW);
+				beginGpuTimer();
+				draw();
+				endStreamFrame();
+				endStateFrame();
+				endGpuTimer();
+			}
+
+			{
+				ProfileScope scope(PHASE_PACE);
+				TRACE_SCOPE("pace");
+				paceFrame();
+			}
 
 			// Swap Frame Buffer in double buffering
-			glfwSwapBuffers(window);
+			{
+				ProfileScope scope(PHASE_SWAP);
+				TRACE_SCOPE("swap");
+				glfwSwapBuffers(window);
+			}
 
 			// Poll for Keyboard and mouse events
-			glfwPollEvents();
+			{
+				ProfileScope scope(PHASE_POLL);
+				TRACE_SCOPE("poll");
+				glfwPollEvents();
+			}
+			endProfileFrame();
 
 			// Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
 			/*  current_time = glfwGetTime(); // Time in seconds
@@ -2564,21 +4624,38 @@ void draw ()
 			last_update_time = current_time;*/
 			//}
 			//cout << "score " << score << '\n';
-			if(score == 600){
+			const Snapshot &state = latestSnapshot();
+			if(state.Score == 600){
 				
-				if(flag == 0)
+				if(state.Flag == 0)
 					break;
 			}
-			if(lifes >= 10 && score < 600){
+			if(state.Lifes >= 10 && state.Score < 600){
 				
 				//display result
 				//some controls for last display
-				if(flag == 0) 
+				if(state.Flag == 0) 
 					break;
 			}	
+			if(state.ReplayDone)
+				break;
 			//}
 
 	}
+	stopSimulation();
+	if(recording)
+		saveRecording(record_path);
+	if(profiler.Logging)
+		writeProfileCsv(profile_path);
+	printStateStats();
+	printStreamStats();
+	printSpriteStats();
+	printFillStats();
+	printFrameStats();
+	printInputStats();
+	printBroadphaseStats();
+	printSleepStats();
+	printProfileStats();
 	if(score == 600)
 	{
 	cout << "SCORE=" << 600 << '\n';
@@ -2594,7 +4671,10 @@ void draw ()
 	glfwTerminate();
 	EXIT_SUCCESS;
 	}
-
+	if(replaying && lifes < 10 && score < 600)
+	cout << "SCORE=" << score << '\n';
+	glfwDestroyWindow(window);
+	glfwTerminate();
 
 
 }
@@ -0,0 +1,30 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec2 localPosition;
+flat in vec2 radii;
+flat in vec3 fragColor;
+flat in vec3 fragColor2;
+
+// output data
+out vec4 color;
+
+void main()
+{
+    // Signed distance to the ellipse edge (first order approximation, exact for circles)
+    vec2 p = localPosition / radii;
+    float k0 = length(p);
+    float k1 = length(localPosition / (radii * radii));
+    float dist = k0 * (k0 - 1.0) / max(k1, 1e-6);
+
+    // Analytic anti-aliasing : fade over one pixel around the edge at any zoom
+    float coverage = clamp(0.5 - dist / max(fwidth(dist), 1e-6), 0.0, 1.0);
+    if (coverage <= 0.0)
+        discard;
+
+    // Spokes : blend in up to half of the second color around the center
+    float angle = atan(localPosition.y, localPosition.x);
+    float spoke = 0.25 + 0.25 * cos(24.0 * angle);
+
+    color = vec4(mix(fragColor, fragColor2, spoke), coverage);
+}
@@ -0,0 +1,47 @@
+#version 330 core
+
+// input data : one quad per ellipse, sent from main program
+layout (location = 0) in vec2 vertexPosition; // quad corner, relative to the ellipse center
+layout (location = 1) in vec4 vertexColor;
+layout (location = 4) in vec2 ellipseRadii;
+layout (location = 5) in vec4 vertexColor2;   // stripe color, same as vertexColor for a plain ellipse
+
+// per instance data : only set for instanced draws, (0,0) and (1,1,1,1) otherwise
+layout (location = 2) in vec2 instanceOffset;
+layout (location = 3) in vec4 instanceTint;
+
+// projection * view : updated once per frame
+layout (std140) uniform Camera
+{
+    mat4 VP;
+};
+
+// model matrices of every object, one column per texel, picked by draw id
+uniform samplerBuffer Models;
+uniform int ModelIndex;
+
+// world z of this draw : keeps painter order under the depth test
+uniform float Depth;
+
+// output data : used by fragment shader
+out vec2 localPosition;
+flat out vec2 radii;
+flat out vec3 fragColor;
+flat out vec3 fragColor2;
+
+void main ()
+{
+    // The fragment shader works in the ellipse's own space, before MVP
+    localPosition = vertexPosition;
+    radii = ellipseRadii;
+
+    fragColor = vertexColor.rgb * instanceTint.rgb;
+    fragColor2 = vertexColor2.rgb * instanceTint.rgb;
+
+    // Output position of the vertex, in clip space : MVP * position
+    mat4 model = mat4(texelFetch(Models, 4*ModelIndex),
+                      texelFetch(Models, 4*ModelIndex + 1),
+                      texelFetch(Models, 4*ModelIndex + 2),
+                      texelFetch(Models, 4*ModelIndex + 3));
+    gl_Position = VP * model * vec4(vertexPosition + instanceOffset, Depth, 1);
+}